@@ -0,0 +1,329 @@
+#ifndef __SIM_EVENTLOG_H__
+#define __SIM_EVENTLOG_H__
+
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sim  {
+
+  /*
+    Compact binary log of timestamped events, each of a type (0 to 63) and
+    with up to three unsigned values, such as agent handles.
+
+    The file starts with an 8 byte magic string and the length of a tick,
+    the unit of time, as a double. It is followed by blocks, each headed by
+    its length in bytes and number of events as uint32s and the tick of its
+    first event as a uint64 (all in host byte order). Each event is a byte
+    holding its type and its number of values, then the ticks since the
+    previous event in the block and the values, all as LEB128 varints.
+    Event times must not decrease.
+
+    Blocks are filled by the caller and written to the file by a
+    background thread, so writing an event costs little more than
+    appending a few bytes.
+  */
+
+  const char event_log_magic[8] = {'S', 'I', 'M', 'L', 'O', 'G', '0', '1'};
+  const unsigned event_log_max_values = 3;
+
+  struct logged_event {
+    unsigned type;
+    uint64_t tick;
+    double time;
+    unsigned num_values;
+    uint32_t values[event_log_max_values];
+  };
+
+  class event_log_writer
+  {
+  public:
+    event_log_writer(const char* path, const double tick,
+		     const size_t block_size = 1 << 16)
+      : tick_size(tick), block_size(block_size),
+	block(header_size + block_size + max_event_size), used(header_size),
+	count(0), base(0), last(0), last_time(-1.0), last_time_tick(0),
+	closing(false)
+    {
+      file = std::fopen(path, "wb");
+      if (file) {
+	std::fwrite(event_log_magic, 1, sizeof event_log_magic, file);
+	std::fwrite(&tick_size, sizeof tick_size, 1, file);
+      }
+      thread = std::thread(&event_log_writer::run, this);
+    }
+
+    ~event_log_writer() { close(); }
+
+    bool good() const { return file != NULL; }
+    double tick() const { return tick_size; }
+
+    void write(const unsigned type, const double time, const uint32_t a)
+    {
+      uint32_t values[] = {a};
+      write(type, time, 1, values);
+    }
+
+    void write(const unsigned type, const double time, const uint32_t a,
+	       const uint32_t b)
+    {
+      uint32_t values[] = {a, b};
+      write(type, time, 2, values);
+    }
+
+    void write(const unsigned type, const double time, const uint32_t a,
+	       const uint32_t b, const uint32_t c)
+    {
+      uint32_t values[] = {a, b, c};
+      write(type, time, 3, values);
+    }
+
+    // Writes out what has been logged and waits for the writer thread
+    void close()
+    {
+      if (!thread.joinable())
+	return;
+      hand_over();
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	closing = true;
+      }
+      ready.notify_one();
+      thread.join();
+      if (file)
+	std::fclose(file);
+      file = NULL;
+    }
+
+  private:
+    static const size_t header_size = 16;
+    static const size_t max_event_size = 1 + 10 + 5 * event_log_max_values;
+
+    std::FILE* file;
+    double tick_size;
+    size_t block_size;
+    // The block being filled, with room for its header at the start
+    std::vector<uint8_t> block;
+    size_t used;
+    uint32_t count;
+    uint64_t base, last;
+    // Events mostly come in runs at the same time
+    double last_time;
+    uint64_t last_time_tick;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::vector<uint8_t> > full;
+    std::vector<std::vector<uint8_t> > spare;
+    bool closing;
+
+    static uint8_t* put_varint(uint8_t* p, uint64_t x)
+    {
+      while (x >= 0x80) {
+	*p++ = (uint8_t) (x | 0x80);
+	x >>= 7;
+      }
+      *p++ = (uint8_t) x;
+      return p;
+    }
+
+    void write(const unsigned type, const double time,
+	       const unsigned num_values, const uint32_t values[])
+    {
+      if (time != last_time) {
+	last_time = time;
+	last_time_tick = (uint64_t) std::llround(time / tick_size);
+      }
+      uint64_t tick = last_time_tick;
+      if (count == 0)
+	base = last = tick;
+      else if (tick < last)
+	tick = last;
+      uint8_t* p = block.data() + used;
+      *p++ = (uint8_t) (type | num_values << 6);
+      p = put_varint(p, tick - last);
+      for (unsigned i = 0; i < num_values; ++i)
+	p = put_varint(p, values[i]);
+      used = p - block.data();
+      last = tick;
+      ++count;
+      if (used >= header_size + block_size)
+	hand_over();
+    }
+
+    // Fills in the block's header and queues it for the thread
+    void hand_over()
+    {
+      if (count == 0)
+	return;
+      uint32_t size = used - header_size;
+      std::memcpy(block.data(), &size, 4);
+      std::memcpy(block.data() + 4, &count, 4);
+      std::memcpy(block.data() + 8, &base, 8);
+      block.resize(used);
+
+      std::vector<uint8_t> next;
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	full.push_back(std::vector<uint8_t>());
+	full.back().swap(block);
+	if (spare.size() > 0) {
+	  next.swap(spare.back());
+	  spare.pop_back();
+	}
+      }
+      ready.notify_one();
+      next.resize(header_size + block_size + max_event_size);
+      block.swap(next);
+      used = header_size;
+      count = 0;
+    }
+
+    void run()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+	ready.wait(lock, [this] { return closing || full.size() > 0; });
+	if (full.size() == 0)
+	  return;
+	std::vector<uint8_t> data;
+	data.swap(full.front());
+	full.pop_front();
+	lock.unlock();
+	if (file)
+	  std::fwrite(data.data(), 1, data.size(), file);
+	lock.lock();
+	spare.push_back(std::vector<uint8_t>());
+	spare.back().swap(data);
+      }
+    }
+  };
+
+  /*
+    Reads back a log written by event_log_writer, one event at a time with
+    next(), or with an input iterator from begin() to end().
+  */
+  class event_log_reader
+  {
+  public:
+    class iterator : public std::iterator<std::input_iterator_tag,
+					  logged_event>
+    {
+    public:
+      iterator(event_log_reader* reader = NULL) : reader(reader)
+      {
+	++*this;
+      }
+
+      const logged_event& operator*() const { return event; }
+      const logged_event* operator->() const { return &event; }
+
+      iterator& operator++()
+      {
+	if (reader && !reader->next(event))
+	  reader = NULL;
+	return *this;
+      }
+
+      bool operator==(const iterator& other) const
+      {
+	return reader == other.reader;
+      }
+      bool operator!=(const iterator& other) const
+      {
+	return reader != other.reader;
+      }
+
+    private:
+      event_log_reader* reader;
+      logged_event event;
+    };
+
+    explicit event_log_reader(const char* path)
+      : tick_size(0.0), position(0), remaining(0), last(0)
+    {
+      file = std::fopen(path, "rb");
+      char magic[sizeof event_log_magic];
+      if (file && (std::fread(magic, 1, sizeof magic, file) != sizeof magic ||
+		   std::memcmp(magic, event_log_magic, sizeof magic) != 0 ||
+		   std::fread(&tick_size, sizeof tick_size, 1, file) != 1)) {
+	std::fclose(file);
+	file = NULL;
+      }
+    }
+
+    ~event_log_reader()
+    {
+      if (file)
+	std::fclose(file);
+    }
+
+    bool good() const { return file != NULL; }
+    double tick() const { return tick_size; }
+
+    // Returns false once there are no more events
+    bool next(logged_event& event)
+    {
+      if (remaining == 0 && !read_block())
+	return false;
+      uint8_t header = block[position++];
+      event.type = header & 0x3f;
+      event.num_values = header >> 6;
+      last += get_varint();
+      event.tick = last;
+      event.time = last * tick_size;
+      for (unsigned i = 0; i < event.num_values; ++i)
+	event.values[i] = get_varint();
+      --remaining;
+      return true;
+    }
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+  private:
+    std::FILE* file;
+    double tick_size;
+    std::vector<uint8_t> block;
+    size_t position;
+    uint32_t remaining;
+    uint64_t last;
+
+    bool read_block()
+    {
+      uint8_t header[16];
+      if (!file || std::fread(header, 1, sizeof header, file) != sizeof header)
+	return false;
+      uint32_t size;
+      std::memcpy(&size, header, 4);
+      std::memcpy(&remaining, header + 4, 4);
+      std::memcpy(&last, header + 8, 8);
+      block.resize(size);
+      position = 0;
+      return std::fread(block.data(), 1, size, file) == size && remaining > 0;
+    }
+
+    uint64_t get_varint()
+    {
+      uint64_t x = 0;
+      unsigned shift = 0;
+      uint8_t byte;
+      do {
+	byte = block[position++];
+	x |= (uint64_t) (byte & 0x7f) << shift;
+	shift += 7;
+      } while (byte & 0x80);
+      return x;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef __SIM_GRAPH_H__
+#define __SIM_GRAPH_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace sim  {
+
+  /*
+    Undirected graph on vertices 0 to n - 1 in compressed sparse row form:
+    the neighbours of vertex v are neighbours[offsets[v]] up to
+    neighbours[offsets[v + 1]], and each edge appears once from each end.
+  */
+  struct csr_graph {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> neighbours;
+
+    size_t num_vertices() const
+    {
+      return offsets.size() > 0 ? offsets.size() - 1 : 0;
+    }
+    size_t num_edges() const { return neighbours.size() / 2; }
+    uint32_t degree(const uint32_t v) const
+    {
+      return offsets[v + 1] - offsets[v];
+    }
+    const uint32_t* begin(const uint32_t v) const
+    {
+      return neighbours.data() + offsets[v];
+    }
+    const uint32_t* end(const uint32_t v) const
+    {
+      return neighbours.data() + offsets[v + 1];
+    }
+  };
+
+  /*
+    Union-find over elements 0 to n - 1, with union by size and path
+    halving, so that any sequence of operations takes near linear time.
+  */
+  class disjoint_sets
+  {
+  public:
+    explicit disjoint_sets(const size_t n = 0) { reset(n); }
+
+    // Makes every element a set of its own
+    void reset(const size_t n)
+    {
+      parents.resize(n);
+      sizes.assign(n, 1);
+      for (size_t i = 0; i < n; ++i)
+	parents[i] = i;
+      num_sets = n;
+    }
+
+    // Adds an element in a set of its own, and returns it
+    uint32_t add()
+    {
+      parents.push_back(parents.size());
+      sizes.push_back(1);
+      ++num_sets;
+      return parents.size() - 1;
+    }
+
+    size_t size() const { return parents.size(); }
+    size_t count() const { return num_sets; }
+
+    uint32_t find(uint32_t x)
+    {
+      while (parents[x] != x) {
+	parents[x] = parents[parents[x]];
+	x = parents[x];
+      }
+      return x;
+    }
+
+    // Merges the sets of a and b, and returns the root of the merged set
+    uint32_t unite(uint32_t a, uint32_t b)
+    {
+      a = find(a);
+      b = find(b);
+      if (a == b)
+	return a;
+      if (sizes[a] < sizes[b])
+	std::swap(a, b);
+      parents[b] = a;
+      sizes[a] += sizes[b];
+      --num_sets;
+      return a;
+    }
+
+    // Size of the set whose root is root
+    uint32_t set_size(const uint32_t root) const { return sizes[root]; }
+
+  private:
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> sizes;
+    size_t num_sets;
+  };
+
+  /*
+    Calls f(begin, end, thread) on each of threads contiguous chunks of 0 to
+    n - 1, in parallel, and returns once all have returned. With threads 0,
+    uses as many as the hardware supports.
+  */
+  template <typename Function>
+  void parallel_for(const size_t n, unsigned threads, Function f)
+  {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max<size_t>(1, std::min<size_t>(threads, n));
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+      workers.push_back(std::thread(f, n * t / threads, n * (t + 1) / threads,
+				    t));
+    f(0, n / threads, 0u);
+    for (auto& worker: workers)
+      worker.join();
+  }
+}
+
+#endif
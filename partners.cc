@@ -25,7 +25,7 @@
      if num_partners > 0 and uniform rng < sexual_drive_attribute:
          partner = min(geometric_distribution(preference_fifs_attribute),
                                               num_partners)
-	 determine hiv transmission risk
+         determine hiv transmission risk
 
   So we have the following attributes per agent:
 
@@ -60,12 +60,28 @@
 */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
 #include <random>
+#include <set>
 #include <sstream>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "eventlog.hh"
+#include "graph.hh"
+#include "queue.hh"
 #include "stats.hh"
 
 thread_local std::mt19937 rng;
@@ -77,10 +93,28 @@ const double WEEK = 1.0 / 52.0;
 const double DAY = 1.0 / YEAR_IN_DAYS;
 const double HOUR = DAY / 24.0;
 
-class Agent;
+// Partner selection walks the geometric CDF for up to this many partners
+const unsigned SMALL_PARTNER_COUNT = 4;
+// Most partners an agent can be given by the equilibrium network initialiser
+const unsigned MAX_INITIAL_PARTNERS = 8;
+// Matching runs on MATCH_THREADS threads only with at least this many
+// seekers, since threads don't pay for themselves on small rounds
+const size_t MIN_PARALLEL_SEEKERS = 4096;
 
 typedef std::unordered_map<const char *, double> ParameterMap;
-typedef std::vector<Agent *> AgentVector;
+
+// Agents refer to each other, and are referred to from outside the
+// population, by 32 bit handles rather than pointers so that they can be
+// moved around in memory.
+typedef uint32_t AgentHandle;
+typedef std::vector<AgentHandle> HandleVector;
+
+// Probability of at least one event in steps steps, given its probability
+// per step
+static inline double scale_probability(const double prob, const unsigned steps)
+{
+  return steps == 1 ? prob : 1.0 - pow(1.0 - prob, steps);
+}
 
 enum Sex {
   MALE = 0,
@@ -88,7 +122,7 @@ enum Sex {
 };
 
 struct Agent {
-  unsigned id;
+  AgentHandle id;
   Sex sex;
   double age;
   /* 0=HIV-
@@ -98,8 +132,11 @@ struct Agent {
      5=HIV+ CDC stage 4
    */
   unsigned hiv;
+  bool art;
   bool alive;
-  AgentVector partners;
+  // Number of people the agent represents
+  unsigned weight;
+  HandleVector partners;
 
   /* Attributes */
   double relationship_stickiness_attribute;
@@ -108,14 +145,40 @@ struct Agent {
   double sexual_drive_attribute;
   double preference_fifs_attribute;
   double force_infection_attribute;
+  // log(1 - preference_fifs_attribute) for partner selection
+  double fifs_log_q;
 
-  void init(unsigned i, const ParameterMap& parameters)
+  // Attributes are left for the caller to set if attributes is false
+  void init(AgentHandle i, Sex s, const ParameterMap& parameters,
+	    const bool attributes = true)
   {
     id = i;
-    sex = std::bernoulli_distribution(0.5)(rng) == 0 ? MALE : FEMALE;
+    sex = s;
     age = std::uniform_real_distribution<double>(15.0, 20.0)(rng);
     hiv = std::min(std::geometric_distribution<int>(0.9)(rng), 5);
+    art = false;
+    alive = true;
+    weight = parameters.at("AGENT_WEIGHT");
+    if (attributes)
+      init_attributes(parameters);
+  }
+
+  // A new, HIV negative, youth entering the model at the entry age
+  void entry(AgentHandle i, Sex s, const ParameterMap& parameters)
+  {
+    id = i;
+    sex = s;
+    age = parameters.at("ENTRY_AGE");
+    hiv = 0;
+    art = false;
     alive = true;
+    weight = parameters.at("AGENT_WEIGHT");
+    partners.clear();
+    init_attributes(parameters);
+  }
+
+  void init_attributes(const ParameterMap& parameters)
+  {
     relationship_stickiness_attribute =
       sim::beta_distribution<>(2.0, parameters.at("MEAN_PARTNERSHIP_TIME") /
 			       parameters.at("TIME_STEP") * 2.0) (rng);
@@ -131,6 +194,7 @@ struct Agent {
     preference_fifs_attribute =
       sim::beta_distribution<>(2.0, 2.0 / parameters.at("PREFERENCE_FIFS")
 			       - 2.0)(rng);
+    fifs_log_q = log(1.0 - preference_fifs_attribute);
     force_infection_attribute = sex == MALE ?
       sim::beta_distribution<>(2.0, 2.0 / parameters.at("MEAN_RISK_HET_MALE_SEX")
 			       - 2.0)(rng) :
@@ -141,16 +205,70 @@ struct Agent {
 
   // EVENTS
 
-  void simple_infection_event(const double prevalence_males,
-			      const double prevalence_females)
+  // Events that run less often than every TIME_STEP are passed the number
+  // of TIME_STEPs they cover.
+
+  // Returns true if the agent breaks up its most recently formed partnership
+  bool breakup_event(const unsigned steps)
+  {
+    return partners.size() > 0 &&
+      std::uniform_real_distribution<double>(0.0, 1.0)(rng) <
+      scale_probability(relationship_stickiness_attribute / partners.size(),
+			steps);
+  }
+
+  // Returns true if the agent looks for a new partner
+  bool seek_partner_event(const unsigned steps)
+  {
+    double prob = partners.size() == 0 ? partner_forming_attribute :
+      concurrency_attribute / partners.size();
+    return std::uniform_real_distribution<double>(0.0, 1.0)(rng) <
+      scale_probability(prob, steps);
+  }
+
+  // Returns the number of times the agent has sex: at most once per
+  // TIME_STEP.
+  unsigned sex_event(const unsigned steps)
+  {
+    if (partners.size() == 0)
+      return 0;
+    if (steps == 1)
+      return std::uniform_real_distribution<double>(0.0, 1.0)(rng) <
+	sexual_drive_attribute;
+    return std::binomial_distribution<unsigned>
+      (steps, sexual_drive_attribute)(rng);
+  }
+
+  // Index in partners of the partner to have sex with. Earlier formed
+  // partners are preferred according to preference_fifs_attribute.
+  unsigned choose_partner(std::mt19937& generator = rng)
+  {
+    unsigned n = partners.size();
+    if (n == 1)
+      return 0;
+    double u = 1.0 -
+      std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+    if (n <= SMALL_PARTNER_COUNT)
+      return sim::truncated_geometric_variate(u, 1.0 -
+					      preference_fifs_attribute, n);
+    return sim::geometric_variate(u, fifs_log_q, n - 1);
+  }
+
+  // partner_prevalence is the prevalence in the opposite sex. Returns
+  // whether the agent was infected.
+  bool simple_infection_event(const double partner_prevalence,
+			      const unsigned steps)
   {
     if (hiv == 0) {
-      double prevalence = sex == MALE ? prevalence_females : prevalence_males;
       double risk_infection = force_infection_attribute *
-	partner_forming_attribute * prevalence;
-      if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) < risk_infection)
+	partner_forming_attribute * partner_prevalence;
+      if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) <
+	  scale_probability(risk_infection, steps)) {
 	hiv = 1;
+	return true;
+      }
     }
+    return false;
   }
 
   void stage_advance_event(const double prob_leave_acute_infection)
@@ -160,203 +278,3642 @@ struct Agent {
       ++hiv;
   }
 
-  // Every agent has to age on each iteration of the simulation
-  void age_event(const double time_elapsed)
+  void art_event(const double prob_start_art)
+  {
+    if (hiv > 1 && !art && std::uniform_real_distribution<double>(0.0, 1.0)(rng)
+	< prob_start_art)
+      art = true;
+  }
+
+  // prob_death is indexed by HIV stage
+  void mortality_event(const double prob_death[])
+  {
+    if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) <
+	prob_death[hiv])
+      alive = false;
+  }
+
+  // Every agent has to age on each iteration of the simulation. Agents who
+  // age past the range the model targets leave it.
+  void age_event(const double time_elapsed, const double exit_age)
   {
     age += time_elapsed;
+    if (age >= exit_age)
+      alive = false;
   }
 
 
 };
 
 
-void
-initialize_agents(AgentVector& agents, const ParameterMap parameters)
-{
-  unsigned i = 0;
-  for (auto &agent : agents) {
-    agent = new Agent();
-    agent->init(i++, parameters);
+/*
+  Agents are matched on age and on their partner forming, concurrency and
+  sexual drive attributes. Each is mapped to [0, 1]: age over the model's
+  age range, and the (heavily skewed) attributes relative to three times
+  their means. The Morton key interleaves the bits of the coordinates so
+  that agents who are close in matching space are mostly close in key
+  order.
+*/
+const unsigned MATCH_DIMS = 4;
+
+struct MatchingSpace {
+  double offset[MATCH_DIMS];
+  double scale[MATCH_DIMS];
+
+  void init(const ParameterMap& parameters)
+  {
+    double time_step = parameters.at("TIME_STEP");
+    double entry_age = parameters.at("ENTRY_AGE");
+    const double means[MATCH_DIMS - 1] = {
+      1.0 / (1.0 + parameters.at("MEAN_TIME_UNTIL_PARTNER") / time_step),
+      1.0 / (1.0 + parameters.at("MEAN_TIME_CONCURRENT") / time_step),
+      1.0 / (1.0 + parameters.at("MEAN_TIME_SEX") / time_step)
+    };
+    offset[0] = entry_age;
+    scale[0] = 1.0 / (parameters.at("EXIT_AGE") - entry_age);
+    for (unsigned i = 1; i < MATCH_DIMS; ++i) {
+      offset[i] = 0.0;
+      scale[i] = 1.0 / (3.0 * means[i - 1]);
+    }
   }
-}
 
-void destroy_agents(AgentVector& agents)
+  void coordinates(const Agent& agent, double x[MATCH_DIMS]) const
+  {
+    const double values[MATCH_DIMS] = {
+      agent.age,
+      agent.partner_forming_attribute,
+      agent.concurrency_attribute,
+      agent.sexual_drive_attribute
+    };
+    for (unsigned i = 0; i < MATCH_DIMS; ++i)
+      x[i] = std::min(std::max((values[i] - offset[i]) * scale[i], 0.0), 1.0);
+  }
+
+  // Squared Euclidean distance
+  double distance(const Agent& a, const Agent& b) const
+  {
+    double x[MATCH_DIMS], y[MATCH_DIMS], d = 0.0;
+    coordinates(a, x);
+    coordinates(b, y);
+    for (unsigned i = 0; i < MATCH_DIMS; ++i)
+      d += (x[i] - y[i]) * (x[i] - y[i]);
+    return d;
+  }
+
+  uint64_t key(const Agent& agent) const
+  {
+    double x[MATCH_DIMS];
+    coordinates(agent, x);
+    uint64_t key = 0;
+    for (unsigned i = 0; i < MATCH_DIMS; ++i)
+      key |= spread_bits(x[i] * 65535.0) << (MATCH_DIMS - 1 - i);
+    return key;
+  }
+
+  // Spaces the low 16 bits of v out to every fourth bit
+  static uint64_t spread_bits(uint64_t v)
+  {
+    v &= 0xFFFF;
+    v = (v | (v << 24)) & 0x000000FF000000FFULL;
+    v = (v | (v << 12)) & 0x000F000F000F000FULL;
+    v = (v | (v << 6)) & 0x0303030303030303ULL;
+    v = (v | (v << 3)) & 0x1111111111111111ULL;
+    return v;
+  }
+};
+
+
+const uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+const AgentHandle NO_HANDLE = std::numeric_limits<AgentHandle>::max();
+const uint32_t SEX_SHIFT = 31;
+const uint32_t INDEX_MASK = (1u << SEX_SHIFT) - 1;
+
+static inline Sex random_sex()
 {
-  for (auto &agent: agents)
-    delete agent;
+  return std::bernoulli_distribution(0.5)(rng) == 0 ? MALE : FEMALE;
 }
 
+// Types of events in the event log, and the values logged with them
+enum LogEvent {
+  LOG_ENTRY = 0,                // agent, sex
+  LOG_REMOVAL = 1,              // agent
+  LOG_FORMATION = 2,            // agent, partner
+  LOG_DISSOLUTION = 3,          // agent, partner
+  LOG_ACT = 4,                  // agent, partner, condom
+  LOG_INFECTION = 5,            // agent[, infecting partner]
+  LOG_STAGE = 6,                // agent, new HIV stage
+  LOG_ART = 7,                  // agent
+  // agent, sex | HIV stage << 1 | ART << 4 | weight << 5, age in ticks
+  LOG_SNAPSHOT = 8
+};
 
-struct Prevalence {
-  unsigned males_alive = 0;
-  unsigned females_alive = 0;
-  unsigned males_infected = 0;
-  unsigned females_infected = 0;
-  double male_prevalence, female_prevalence;
+/*
+  Writes events to the binary event log, if one is open, with the time
+  last set by the engine. Engines that can't keep times in order detach
+  the writer while they run.
+*/
+struct EventLog {
+  sim::event_log_writer* writer = NULL;
+  double time = 0.0;
+
+  // Resolution of logged times, or 0 if nothing is logged
+  double tick() const
+  {
+    return writer ? writer->tick() : 0.0;
+  }
+
+  void write(const LogEvent event, const AgentHandle agent)
+  {
+    if (writer)
+      writer->write(event, time, agent);
+  }
+
+  void write(const LogEvent event, const AgentHandle agent,
+	     const uint32_t value)
+  {
+    if (writer)
+      writer->write(event, time, agent, value);
+  }
+
+  void write(const LogEvent event, const AgentHandle agent,
+	     const uint32_t partner, const uint32_t value)
+  {
+    if (writer)
+      writer->write(event, time, agent, partner, value);
+  }
+
+  // Logs the living agents and their partnerships, as the starting point
+  // for replaying the log
+  void snapshot(const std::vector<Agent> agents[2])
+  {
+    if (!writer)
+      return;
+    for (unsigned s = 0; s < 2; ++s)
+      for (auto& agent: agents[s])
+	if (agent.alive)
+	  write(LOG_SNAPSHOT, agent.id, agent.sex | agent.hiv << 1 |
+		agent.art << 4 | agent.weight << 5,
+		std::llround(agent.age / writer->tick()));
+    for (auto& agent: agents[MALE])
+      if (agent.alive)
+	for (auto& partner: agent.partners)
+	  write(LOG_FORMATION, agent.id, partner);
+  }
+
+  // Logs changes in an agent's HIV stage and ART since hiv and art
+  void changes(const Agent& agent, const unsigned hiv, const bool art)
+  {
+    if (hiv == 0 && agent.hiv > 0)
+      write(LOG_INFECTION, agent.id);
+    // An agent can be infected and leave acute infection in the same step
+    if (agent.hiv > std::max(hiv, 1u))
+      write(LOG_STAGE, agent.id, agent.hiv);
+    if (agent.art != art)
+      write(LOG_ART, agent.id);
+  }
+};
+
+/*
+  Who infected whom, when, and at what stage of the infector's infection,
+  for every infection through sex with an infected partner, in order.
+  Records take 16 bytes, with dates kept as floats relative to the first
+  infection's. Handles are reused once agents leave the model, so a handle
+  in a record refers to the agent who holds it as of its latest infection
+  before that record.
+*/
+class TransmissionTree {
+public:
+  struct Transmission {
+    AgentHandle infector;
+    AgentHandle infectee;
+    float time;
+    uint8_t stage;
+  };
+
+  size_t size() const { return transmissions.size(); }
+  const Transmission& operator[](const size_t i) const
+  {
+    return transmissions[i];
+  }
+  double date(const size_t i) const { return origin + transmissions[i].time; }
+
+  void record(const AgentHandle infector, const AgentHandle infectee,
+	      const double date, const unsigned stage)
+  {
+    if (transmissions.size() == 0)
+      origin = date;
+    transmissions.push_back({infector, infectee, (float) (date - origin),
+			     (uint8_t) stage});
+  }
+
+  void clear() { transmissions.clear(); }
+
+  // Proportion of transmissions from infectors in the given stage
+  double fraction_from_stage(const unsigned stage) const
+  {
+    size_t n = 0;
+    for (auto& t: transmissions)
+      n += t.stage == stage;
+    return (double) n / transmissions.size();
+  }
+
+  // Times from infectors' infections to their transmissions, for
+  // infectors whose own infections are in the tree
+  std::vector<double> generation_times() const
+  {
+    // Time of the latest infection of each handle so far
+    std::vector<float> infected;
+    std::vector<double> times;
+    for (auto& t: transmissions) {
+      if (t.infector < infected.size() && infected[t.infector] >= 0.0)
+	times.push_back(t.time - infected[t.infector]);
+      if (t.infectee >= infected.size())
+	infected.resize(t.infectee + 1, -1.0);
+      infected[t.infectee] = t.time;
+    }
+    return times;
+  }
+
+  // Writes a CSV line per transmission
+  void write(std::ostream& out) const
+  {
+    for (size_t i = 0; i < transmissions.size(); ++i)
+      out << "transmission," << transmissions[i].infector << ","
+	  << transmissions[i].infectee << "," << date(i) << ","
+	  << (unsigned) transmissions[i].stage << std::endl;
+  }
+
+private:
+  double origin = 0.0;
+  std::vector<Transmission> transmissions;
+};
+
+/*
+  Connected components of the partnership network, kept up to date
+  cheaply: formations merge components as they happen, while dissolutions
+  and removals are only taken into account when the components are rebuilt
+  from scratch, which engines do every COMPONENT_REBUILD_INTERVAL. Between
+  rebuilds the components are those the network would have if nothing had
+  dissolved, so the size of the largest is an upper bound. A recycled
+  handle likewise stays in its old holder's component until the next
+  rebuild. Elements are agent handles.
+*/
+class ComponentTracker {
+public:
+  bool enabled = false;
+
+  // Components of more than one agent
+  size_t count() const { return num_components; }
+  size_t largest() const { return largest_size; }
+
+  void unite(const AgentHandle a, const AgentHandle b)
+  {
+    while (sets.size() <= std::max(a, b))
+      sets.add();
+    uint32_t root_a = sets.find(a), root_b = sets.find(b);
+    if (root_a == root_b)
+      return;
+    unsigned singletons = (sets.set_size(root_a) == 1) +
+      (sets.set_size(root_b) == 1);
+    if (singletons == 2)
+      ++num_components;
+    else if (singletons == 0)
+      --num_components;
+    largest_size = std::max<size_t>(largest_size,
+				    sets.set_size(sets.unite(root_a, root_b)));
+  }
+
+  void rebuild(const std::vector<Agent> agents[2], const size_t num_handles)
+  {
+    sets.reset(num_handles);
+    num_components = largest_size = 0;
+    for (auto& agent: agents[MALE])
+      if (agent.alive)
+	for (auto& partner: agent.partners)
+	  unite(agent.id, partner);
+  }
+
+private:
+  sim::disjoint_sets sets;
+  size_t num_components = 0, largest_size = 0;
+};
+
+/*
+  Agents are stored by value, males and females in separate vectors so that
+  per sex loops don't branch on sex and matchers can scan each sex
+  directly. Everything else refers to agents by handle, and slots maps each
+  handle to the agent's current slot (sex in the top bit, index below it),
+  so agents can be moved (compacted, reordered) by updating the table. A
+  dead agent's handle keeps pointing at its slot until the slot is reused or
+  compacted away, after which it maps to NO_SLOT. Handles are only reused
+  once given up with recycle(), which engines do as soon as nothing holds
+  a dead agent's handle, so that the handle table, and everything else
+  indexed by handle, grows with the living population rather than with
+  everyone who has ever lived.
+*/
+struct Population {
+  std::vector<Agent> agents[2];
+  std::vector<uint32_t> slots;
+  std::vector<uint32_t> free_slots[2];
+  std::vector<AgentHandle> free_handles;
+  EventLog log;
+  TransmissionTree transmissions;
+  ComponentTracker components;
+  // People infected so far, by sex, for measuring incidence
+  unsigned new_infections[2] = {0, 0};
+
+  Agent& operator[](const AgentHandle handle)
+  {
+    uint32_t slot = slots[handle];
+    return agents[slot >> SEX_SHIFT][slot & INDEX_MASK];
+  }
+
+  const Agent& operator[](const AgentHandle handle) const
+  {
+    uint32_t slot = slots[handle];
+    return agents[slot >> SEX_SHIFT][slot & INDEX_MASK];
+  }
+
+  size_t size() const
+  {
+    return agents[MALE].size() + agents[FEMALE].size();
+  }
+
+  size_t num_free() const
+  {
+    return free_slots[MALE].size() + free_slots[FEMALE].size();
+  }
+
+  // Returns the handle of a new, uninitialized, agent. Dead agents' slots are
+  // reused before the agent vector is grown.
+  AgentHandle add(const Sex sex)
+  {
+    std::vector<Agent>& storage = agents[sex];
+    uint32_t index;
+    if (free_slots[sex].size() > 0) {
+      index = free_slots[sex].back();
+      free_slots[sex].pop_back();
+      if (storage[index].id != NO_HANDLE)
+	slots[storage[index].id] = NO_SLOT;
+    } else {
+      index = storage.size();
+      storage.push_back(Agent());
+    }
+    AgentHandle handle;
+    if (free_handles.size() > 0) {
+      handle = free_handles.back();
+      free_handles.pop_back();
+      slots[handle] = sex << SEX_SHIFT | index;
+    } else {
+      handle = slots.size();
+      slots.push_back(sex << SEX_SHIFT | index);
+    }
+    storage[index].id = handle;
+    log.write(LOG_ENTRY, handle, sex);
+    return handle;
+  }
+
+  bool is_alive(const AgentHandle handle) const
+  {
+    return slots[handle] != NO_SLOT && (*this)[handle].alive;
+  }
+
+  // Called once an agent has died or left the model
+  void remove(Agent& agent)
+  {
+    log.write(LOG_REMOVAL, agent.id);
+    remove_partnerships(agent);
+    free_slots[agent.sex].push_back(slots[agent.id] & INDEX_MASK);
+  }
+
+  // Like remove(), but the agent's handle is also given up for reuse, for
+  // agents who are only simulated individually for a while, and whose
+  // handles nothing else holds on to. Agents already removed can be
+  // recycled too.
+  void recycle(Agent& agent)
+  {
+    if (agent.alive) {
+      agent.alive = false;
+      remove(agent);
+    }
+    slots[agent.id] = NO_SLOT;
+    free_handles.push_back(agent.id);
+    agent.id = NO_HANDLE;
+  }
+
+  void form_partnership(Agent& a, Agent& b)
+  {
+    a.partners.push_back(b.id);
+    b.partners.push_back(a.id);
+    log.write(LOG_FORMATION, a.id, b.id);
+    if (components.enabled)
+      components.unite(a.id, b.id);
+  }
+
+  void dissolve_partnership(Agent& agent, const AgentHandle partner)
+  {
+    log.write(LOG_DISSOLUTION, agent.id, partner);
+    HandleVector& partners = (*this)[partner].partners;
+    partners.erase(std::find(partners.begin(), partners.end(), agent.id));
+    agent.partners.erase(std::find(agent.partners.begin(),
+				   agent.partners.end(), partner));
+  }
+
+  void remove_partnerships(Agent& agent)
+  {
+    for (auto& handle: agent.partners) {
+      HandleVector& partners = (*this)[handle].partners;
+      partners.erase(std::find(partners.begin(), partners.end(), agent.id));
+    }
+    agent.partners.clear();
+  }
+
+  // Rebuilds the handle table and free lists after agents have been moved
+  void reindex()
+  {
+    for (uint32_t s = 0; s < 2; ++s) {
+      free_slots[s].clear();
+      for (uint32_t i = 0; i < agents[s].size(); ++i) {
+	if (agents[s][i].id != NO_HANDLE)
+	  slots[agents[s][i].id] = s << SEX_SHIFT | i;
+	if (!agents[s][i].alive)
+	  free_slots[s].push_back(i);
+      }
+    }
+  }
+
+  void compact()
+  {
+    for (auto& storage: agents) {
+      for (auto& agent: storage)
+	if (!agent.alive && agent.id != NO_HANDLE)
+	  slots[agent.id] = NO_SLOT;
+      storage.erase(std::remove_if(storage.begin(), storage.end(),
+				   [](const Agent& agent) {
+				     return !agent.alive;
+				   }),
+		    storage.end());
+    }
+    reindex();
+  }
+
+  // Compacts the population and sorts each sex by matching key so that
+  // agents likely to be matched with each other are near each other in
+  // memory.
+  void reorder(const MatchingSpace& space)
+  {
+    compact();
+    for (auto& storage: agents) {
+      std::vector<std::pair<uint64_t, uint32_t> > keys(storage.size());
+      for (uint32_t i = 0; i < storage.size(); ++i)
+	keys[i] = std::make_pair(space.key(storage[i]), i);
+      std::sort(keys.begin(), keys.end());
+      std::vector<Agent> sorted;
+      sorted.reserve(storage.size());
+      for (auto& key: keys)
+	sorted.push_back(std::move(storage[key.second]));
+      storage.swap(sorted);
+    }
+    reindex();
+  }
 };
 
-static Prevalence calc_prevalence(const AgentVector& agents)
+// Each sex's seekers as (matching key, handle) pairs in key order
+static void sort_by_key(const Population& population,
+			const MatchingSpace& space,
+			const HandleVector seekers[2],
+			std::vector<std::pair<uint64_t, AgentHandle> > keys[2])
 {
-  Prevalence p;
-  for (auto& agent: agents) {
-    if (agent->alive) {
-      if (agent->sex == MALE) {
-	++p.males_alive;
-	if (agent->hiv > 0)
-	  ++p.males_infected;
-      } else {
-	++p.females_alive;
-	if (agent->hiv > 0)
-	  ++p.females_infected;
+  for (unsigned s = 0; s < 2; ++s) {
+    keys[s].resize(seekers[s].size());
+    for (size_t i = 0; i < seekers[s].size(); ++i)
+      keys[s][i] = std::make_pair(space.key(population[seekers[s][i]]),
+				  seekers[s][i]);
+    std::sort(keys[s].begin(), keys[s].end());
+  }
+}
+
+/*
+  Pairs male and female seekers who are close to each other in matching
+  space. Both sexes' seekers are sorted by matching key, and each male, in
+  key order, takes the nearest unmatched female who isn't already a partner
+  from among the neighbourhood females on either side of him in key
+  order. Seekers who aren't matched stay single for this step.
+*/
+static void nearest_key_match(Population& population,
+			      const MatchingSpace& space,
+			      HandleVector seekers[2],
+			      const unsigned neighbourhood)
+{
+  std::vector<std::pair<uint64_t, AgentHandle> > keys[2];
+  sort_by_key(population, space, seekers, keys);
+  const auto& males = keys[MALE];
+  const auto& females = keys[FEMALE];
+  std::vector<bool> matched(females.size(), false);
+
+  size_t position = 0;
+  for (size_t i = 0; i < males.size(); ++i) {
+    Agent& male = population[males[i].second];
+    while (position < females.size() &&
+	   females[position].first < males[i].first)
+      ++position;
+    size_t best = females.size();
+    double best_distance = std::numeric_limits<double>::max();
+    size_t begin = position > neighbourhood ? position - neighbourhood : 0;
+    size_t end = std::min(females.size(), position + neighbourhood);
+    for (size_t j = begin; j < end; ++j) {
+      if (matched[j] ||
+	  std::find(male.partners.begin(), male.partners.end(),
+		    females[j].second) != male.partners.end())
+	continue;
+      double d = space.distance(male, population[females[j].second]);
+      if (d < best_distance) {
+	best_distance = d;
+	best = j;
       }
     }
+    if (best < females.size()) {
+      matched[best] = true;
+      population.form_partnership(male, population[females[best].second]);
+    }
   }
-  p.male_prevalence = (double) p.males_infected / p.males_alive;
-  p.female_prevalence = (double) p.females_infected / p.females_alive;
-  return p;
 }
 
-// On each step of the iteration we write out CSV data
-void report(double date,  const AgentVector& agents)
+/*
+  Gale-Shapley stable matching of seekers, with preferences by distance in
+  matching space. Each male's preference list is bounded to the candidates
+  nearest him from among the neighbourhood females on either side of him
+  in key order, less his partners, and females prefer nearer proposers.
+  Proposals are made in rounds: every free male proposes to the next
+  female on his list, in parallel, and each female keeps the nearest of
+  her proposers and her current fiancé, ties going to the male with the
+  lower key, so the matching doesn't depend on the number of threads.
+  Males whose lists run out stay single for this step.
+*/
+static void stable_match(Population& population, const MatchingSpace& space,
+			 HandleVector seekers[2], const unsigned neighbourhood,
+			 const unsigned candidates, const unsigned threads)
 {
-  // date, num agents, num alive, num infected, num alive infected
-  Prevalence p = calc_prevalence(agents);
+  std::vector<std::pair<uint64_t, AgentHandle> > keys[2];
+  sort_by_key(population, space, seekers, keys);
+  const auto& males = keys[MALE];
+  const auto& females = keys[FEMALE];
+  const Population& agents = population;
+  if (males.size() == 0 || females.size() == 0 || candidates == 0)
+    return;
 
-  unsigned hiv[6] = {0,0,0,0,0,0};
-  for (auto & agent: agents)
-    ++hiv[agent->hiv];
+  // Preference lists of (distance, female) pairs, nearest first
+  typedef std::pair<float, uint32_t> Candidate;
+  std::vector<Candidate> preferences(males.size() * candidates);
+  std::vector<uint32_t> lengths(males.size());
+  auto list_candidates = [&](size_t begin, size_t end, unsigned) {
+    std::vector<Candidate> window;
+    size_t position =
+      std::lower_bound(females.begin(), females.end(),
+		       std::make_pair(males[begin].first, AgentHandle(0))) -
+      females.begin();
+    for (size_t i = begin; i < end; ++i) {
+      const Agent& male = agents[males[i].second];
+      while (position < females.size() &&
+	     females[position].first < males[i].first)
+	++position;
+      window.clear();
+      size_t first = position > neighbourhood ? position - neighbourhood : 0;
+      size_t last = std::min(females.size(), position + neighbourhood);
+      for (size_t j = first; j < last; ++j)
+	if (std::find(male.partners.begin(), male.partners.end(),
+		      females[j].second) == male.partners.end())
+	  window.push_back(Candidate(space.distance(male,
+						    agents[females[j].second]),
+				     j));
+      size_t n = std::min<size_t>(candidates, window.size());
+      std::partial_sort(window.begin(), window.begin() + n, window.end());
+      std::copy(window.begin(), window.begin() + n,
+		preferences.begin() + i * candidates);
+      lengths[i] = n;
+    }
+  };
+  sim::parallel_for(males.size(), threads, list_candidates);
 
-  std::cout << date << ", "
-	    << agents.size() << ", "
-	    << p.males_alive + p.females_alive << ", "
-	    << p.males_infected + p.females_infected << ", "
-	    << (double) (p.males_infected + p.females_infected) /
-    (p.males_alive + p.females_alive) << ", "
-	    << p.males_alive << ", "
-	    << p.males_infected << ", "
-	    << p.male_prevalence << ", "
-	    << p.females_alive << ", "
-	    << p.females_infected << ", "
-	    << p.female_prevalence << ", "
-	    << hiv[0] << ", " << hiv[1] << ", " << hiv[2] << ", "
-	    << hiv[3] << ", " << hiv[4] << ", " << hiv[5]
-	    << std::endl;
+  // Each female's best offer so far, as the bits of the (non-negative)
+  // distance above the male's index, so that the best is the smallest and
+  // can be kept with an atomic minimum
+  const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+  std::vector<std::atomic<uint64_t> > offers(females.size());
+  for (auto& offer: offers)
+    offer.store(std::numeric_limits<uint64_t>::max());
+  std::vector<uint32_t> fiances(females.size(), NONE);
+  std::vector<uint32_t> proposed(males.size(), 0);
+  std::vector<uint32_t> free, still_free;
+  for (uint32_t i = 0; i < males.size(); ++i)
+    if (lengths[i] > 0)
+      free.push_back(i);
+
+  auto propose = [&](size_t begin, size_t end, unsigned) {
+    for (size_t k = begin; k < end; ++k) {
+      uint32_t male = free[k];
+      const Candidate& c = preferences[male * candidates + proposed[male]++];
+      uint32_t bits;
+      std::memcpy(&bits, &c.first, sizeof bits);
+      uint64_t offer = (uint64_t) bits << 32 | male;
+      uint64_t best = offers[c.second].load();
+      while (offer < best &&
+	     !offers[c.second].compare_exchange_weak(best, offer))
+	;
+    }
+  };
+
+  while (free.size() > 0) {
+    sim::parallel_for(free.size(),
+		      free.size() < MIN_PARALLEL_SEEKERS ? 1 : threads, propose);
+    // Winning proposers are engaged, jilting any previous fiancé
+    still_free.clear();
+    for (auto male: free) {
+      uint32_t female =
+	preferences[male * candidates + proposed[male] - 1].second;
+      if ((uint32_t) offers[female].load() == male) {
+	uint32_t jilted = fiances[female];
+	if (jilted != NONE && proposed[jilted] < lengths[jilted])
+	  still_free.push_back(jilted);
+	fiances[female] = male;
+      } else if (proposed[male] < lengths[male])
+	still_free.push_back(male);
+    }
+    free.swap(still_free);
+  }
+
+  for (size_t j = 0; j < females.size(); ++j)
+    if (fiances[j] != NONE)
+      population.form_partnership(population[males[fiances[j]].second],
+				  population[females[j].second]);
 }
 
-void summary(const unsigned sim_no, const char* description,
-	     const AgentVector& agents, ParameterMap &outputs)
+/*
+  Approximate matching by locality-sensitive hashing. Matching space is
+  cut into a grid of cubes of side width, shifted randomly on every call,
+  and seekers hash to the bucket of their cube. Each male takes the
+  nearest female who isn't already a partner from among up to
+  neighbourhood in his own bucket, and males left over then look in the
+  buckets next to it along each axis. Time is linear in the number of
+  seekers; narrower buckets give nearer partners but more leftovers.
+*/
+static void lsh_match(Population& population, const MatchingSpace& space,
+		      HandleVector seekers[2], const unsigned neighbourhood,
+		      double width)
 {
-  unsigned males = 0, females, hiv_males = 0, hiv_females = 0;
-  std::vector<unsigned> hiv(6);
-  double avg_age = 0.0;
-  double youngest = agents[0]->age;
-  double oldest = agents[0]->age;
-  for (auto& agent: agents) {
-    ++hiv[agent->hiv];
-    if (agent->sex == MALE) {
-      ++males;
-      if (agent->hiv > 0) ++hiv_males;
-    } else {
-      if (agent->hiv > 0) ++hiv_females;
+  // Cells are numbered in a byte per axis
+  width = std::max(width, 1.0 / 254.0);
+  const int cells = std::ceil(1.0 / width) + 1;
+  double shift[MATCH_DIMS];
+  std::uniform_real_distribution<double> uniform(0.0, width);
+  for (auto& s: shift)
+    s = uniform(rng);
+  auto cell = [&](const Agent& agent, int c[MATCH_DIMS]) -> uint32_t {
+    double x[MATCH_DIMS];
+    space.coordinates(agent, x);
+    uint32_t id = 0;
+    for (unsigned d = 0; d < MATCH_DIMS; ++d) {
+      c[d] = (x[d] + shift[d]) / width;
+      id |= (uint32_t) c[d] << 8 * d;
+    }
+    return id;
+  };
+
+  std::unordered_map<uint32_t, HandleVector> buckets;
+  int c[MATCH_DIMS];
+  for (auto& handle: seekers[FEMALE])
+    buckets[cell(population[handle], c)].push_back(handle);
+
+  // Looks through up to budget females of a bucket for one nearer than the
+  // best so far
+  HandleVector* best_bucket;
+  size_t best;
+  double best_distance;
+  auto search = [&](const Agent& male, const uint32_t id, unsigned& budget) {
+    auto found = buckets.find(id);
+    if (found == buckets.end())
+      return;
+    HandleVector& bucket = found->second;
+    for (size_t j = 0; j < bucket.size() && budget > 0; ++j, --budget) {
+      if (std::find(male.partners.begin(), male.partners.end(),
+		    bucket[j]) != male.partners.end())
+	continue;
+      double d = space.distance(male, population[bucket[j]]);
+      if (d < best_distance) {
+	best_distance = d;
+	best_bucket = &bucket;
+	best = j;
+      }
     }
-    avg_age += agent->age;
-    if (agent->age > oldest) oldest = agent->age;
-    if (agent->age < youngest) youngest = agent->age;
+  };
+  auto take = [&](Agent& male) -> bool {
+    if (!best_bucket)
+      return false;
+    population.form_partnership(male, population[(*best_bucket)[best]]);
+    (*best_bucket)[best] = best_bucket->back();
+    best_bucket->pop_back();
+    return true;
+  };
+
+  HandleVector leftovers;
+  for (auto& handle: seekers[MALE]) {
+    Agent& male = population[handle];
+    unsigned budget = neighbourhood;
+    best_bucket = NULL;
+    best_distance = std::numeric_limits<double>::max();
+    search(male, cell(male, c), budget);
+    if (!take(male))
+      leftovers.push_back(handle);
   }
-  std::ostringstream prefix_stream;
-  prefix_stream << "summary," << sim_no << "," << description << ",";
-  std::string prefix = prefix_stream.str();
-  std::cout << prefix
-	    << "males: " << males << std::endl;
-  females = agents.size() - males;
-  std::cout << prefix
-	    << "females," << agents.size() - males << std::endl;
-  std::cout << prefix
-	    << "youngest," << youngest << std::endl;
-  std::cout << prefix
-	    << "oldest," << oldest << std::endl;
-  std::cout << prefix
-	    << "Average age," << avg_age / agents.size() << std::endl;
-  for (size_t i = 0; i < 6; ++i)
-    std::cout << prefix << "HIV " << i << " " << hiv[i] << std::endl;
-  std::cout << prefix
-	    << "Male prevalence: " << (double) hiv_males / males << std::endl;
-  std::cout << prefix
-	    << "Female prevalence: " << (double) hiv_females / females
-	    << std::endl;
-  // Incidence
-  if(outputs.find("HIV_MALES") != outputs.end()) {
-    unsigned diff_hiv_males = hiv_males - outputs.at("HIV_MALES");
-    unsigned diff_hiv_females = hiv_females - outputs.at("HIV_FEMALES");
-    std::cout << prefix << "Male incidence: " << (double) diff_hiv_males / males
-	      << std::endl;
-    std::cout << prefix
-	      << "Female incidence: " << (double) diff_hiv_females / females
-	      << std::endl;
-    std::cout << prefix
-	      << "Incidence: " << (double) (diff_hiv_males + diff_hiv_females) /
-      agents.size() << std::endl;
+  for (auto& handle: leftovers) {
+    Agent& male = population[handle];
+    unsigned budget = neighbourhood;
+    best_bucket = NULL;
+    best_distance = std::numeric_limits<double>::max();
+    uint32_t id = cell(male, c);
+    for (unsigned d = 0; d < MATCH_DIMS; ++d) {
+      if (c[d] > 0)
+	search(male, id - (1 << 8 * d), budget);
+      if (c[d] + 1 < cells)
+	search(male, id + (1 << 8 * d), budget);
+    }
+    take(male);
   }
-  outputs["HIV_MALES"] = hiv_males;
-  outputs["HIV_FEMALES"] = hiv_females;
 }
 
-void simulate(AgentVector& agents,
-	      const ParameterMap& parameters)
+/*
+  Nearest key matching in parallel, by handshakes. In each round every
+  unmatched seeker picks the nearest unmatched seeker of the opposite sex
+  who isn't already a partner from among the neighbourhood on either side
+  of it in key order, and pairs who pick each other are matched. Picks
+  only read the state left by the previous round, so they are made on
+  separate threads without any seeker being claimed twice, and the
+  matching is the same for any number of threads. Rounds continue until
+  one matches nobody, up to rounds of them.
+*/
+static void handshake_match(Population& population,
+			    const MatchingSpace& space,
+			    HandleVector seekers[2],
+			    const unsigned neighbourhood,
+			    const unsigned rounds, const unsigned threads)
 {
-  double num_years = parameters.at("NUM_YEARS");
-  double time_step = parameters.at("TIME_STEP");
-  double start_date = parameters.at("START_DATE");
-  double prob_leave_acute_infection = parameters.at("LEAVE_ACUTE_INFECTION");
-  unsigned num_iterations = num_years / time_step;
-
-  for (unsigned i = 0; i < num_iterations; ++i) {
-    shuffle(agents.begin(), agents.end(), rng);
+  std::vector<std::pair<uint64_t, AgentHandle> > keys[2];
+  sort_by_key(population, space, seekers, keys);
+  if (keys[MALE].size() == 0 || keys[FEMALE].size() == 0)
+    return;
+  const Population& agents = population;
+  const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+  std::vector<uint8_t> matched[2];
+  std::vector<uint32_t> picks[2];
+  for (unsigned s = 0; s < 2; ++s) {
+    matched[s].assign(keys[s].size(), 0);
+    picks[s].resize(keys[s].size());
+  }
 
-    Prevalence p = calc_prevalence(agents);
+  auto pick = [&](const unsigned sex, const size_t begin, const size_t end) {
+    const auto& mine = keys[sex];
+    const auto& theirs = keys[1 - sex];
+    if (begin == end)
+      return;
+    size_t position =
+      std::lower_bound(theirs.begin(), theirs.end(),
+		       std::make_pair(mine[begin].first, AgentHandle(0))) -
+      theirs.begin();
+    for (size_t i = begin; i < end; ++i) {
+      while (position < theirs.size() &&
+	     theirs[position].first < mine[i].first)
+	++position;
+      picks[sex][i] = NONE;
+      if (matched[sex][i])
+	continue;
+      const Agent& agent = agents[mine[i].second];
+      double best_distance = std::numeric_limits<double>::max();
+      size_t first = position > neighbourhood ? position - neighbourhood : 0;
+      size_t last = std::min(theirs.size(), position + neighbourhood);
+      for (size_t j = first; j < last; ++j) {
+	if (matched[1 - sex][j] ||
+	    std::find(agent.partners.begin(), agent.partners.end(),
+		      theirs[j].second) != agent.partners.end())
+	  continue;
+	double d = space.distance(agent, agents[theirs[j].second]);
+	if (d < best_distance) {
+	  best_distance = d;
+	  picks[sex][i] = j;
+	}
+      }
+    }
+  };
+  auto pick_males = [&](size_t begin, size_t end, unsigned) {
+    pick(MALE, begin, end);
+  };
+  auto pick_females = [&](size_t begin, size_t end, unsigned) {
+    pick(FEMALE, begin, end);
+  };
 
-    for (auto & agent: agents) {
-      if (agent->alive) {
-	agent->simple_infection_event(p.male_prevalence, p.female_prevalence);
-	agent->stage_advance_event(prob_leave_acute_infection);
-	agent->age_event(time_step);
+  unsigned pick_threads = keys[MALE].size() + keys[FEMALE].size() <
+    MIN_PARALLEL_SEEKERS ? 1 : threads;
+  for (unsigned r = 0; r < rounds; ++r) {
+    sim::parallel_for(keys[MALE].size(), pick_threads, pick_males);
+    sim::parallel_for(keys[FEMALE].size(), pick_threads, pick_females);
+    unsigned handshakes = 0;
+    for (uint32_t i = 0; i < keys[MALE].size(); ++i) {
+      uint32_t j = picks[MALE][i];
+      if (j != NONE && picks[FEMALE][j] == i) {
+	matched[MALE][i] = matched[FEMALE][j] = 1;
+	population.form_partnership(population[keys[MALE][i].second],
+				    population[keys[FEMALE][j].second]);
+	++handshakes;
       }
     }
-    report(start_date + time_step * i, agents);
+    if (handshakes == 0)
+      break;
   }
 }
 
-
-int main(int argc, char *argv[])
+/*
+  Matching by age band alone, to an age mixing matrix: mixing[i] draws
+  the band of the partner of a male in band i. Female seekers are
+  shuffled into a stack per band, and each male takes the female on top
+  of the stack of the band he draws, drawing again, up to attempts times
+  in all, if it is empty or she is already a partner.
+*/
+static void age_mixing_match(Population& population,
+			     const MatchingSpace& space,
+			     HandleVector seekers[2],
+			     const std::vector<sim::alias_table<> >& mixing,
+			     const unsigned attempts)
 {
-  // Set our parameters
-  ParameterMap parameters, outputs;
+  unsigned bands = mixing.size();
+  auto band = [&](const Agent& agent) -> unsigned {
+    double x[MATCH_DIMS];
+    space.coordinates(agent, x);
+    return std::min<unsigned>(x[0] * bands, bands - 1);
+  };
+  std::shuffle(seekers[FEMALE].begin(), seekers[FEMALE].end(), rng);
+  std::vector<HandleVector> stacks(bands);
+  for (auto& handle: seekers[FEMALE])
+    stacks[band(population[handle])].push_back(handle);
 
-  parameters["NUM_YEARS"] = 2.0;
-  parameters["TIME_STEP"] = DAY;
-  parameters["START_DATE"] = 2015.0;
+  for (auto& handle: seekers[MALE]) {
+    Agent& male = population[handle];
+    const sim::alias_table<>& row = mixing[band(male)];
+    for (unsigned a = 0; a < attempts; ++a) {
+      HandleVector& stack = stacks[row(rng)];
+      if (stack.size() == 0 ||
+	  std::find(male.partners.begin(), male.partners.end(),
+		    stack.back()) != male.partners.end())
+	continue;
+      population.form_partnership(male, population[stack.back()]);
+      stack.pop_back();
+      break;
+    }
+  }
+}
 
-  /* Parameters to estimate */
-  parameters["MEAN_TIME_UNTIL_PARTNER"] = YEAR / 4.0;
-  parameters["MEAN_PARTNERSHIP_TIME"] = YEAR / 4.0;
-  parameters["MEAN_TIME_CONCURRENT"] = YEAR;
-  parameters["MEAN_TIME_SEX"] = DAY;
-  parameters["PREFERENCE_FIFS"] = 0.5;
-  parameters["MEAN_RISK_HET_MALE_SEX"] = 0.01;
-  parameters["MEAN_RISK_HET_FEMALE_SEX"] = 0.02;
-  parameters["LEAVE_ACUTE_INFECTION"] = 0.0238095238;
+/*
+  Exact greedy nearest neighbour matching, against which benchmark_matching()
+  measures the others: each male in turn takes the nearest unmatched female
+  who isn't already a partner. Takes time proportional to the product of
+  the numbers of male and female seekers.
+*/
+static void exact_nearest_match(Population& population,
+				const MatchingSpace& space,
+				HandleVector seekers[2])
+{
+  HandleVector females = seekers[FEMALE];
+  for (auto& handle: seekers[MALE]) {
+    Agent& male = population[handle];
+    size_t best = females.size();
+    double best_distance = std::numeric_limits<double>::max();
+    for (size_t j = 0; j < females.size(); ++j) {
+      if (std::find(male.partners.begin(), male.partners.end(),
+		    females[j]) != male.partners.end())
+	continue;
+      double d = space.distance(male, population[females[j]]);
+      if (d < best_distance) {
+	best_distance = d;
+	best = j;
+      }
+    }
+    if (best < females.size()) {
+      population.form_partnership(male, population[females[best]]);
+      females[best] = females.back();
+      females.pop_back();
+    }
+  }
+}
+
+enum MatchingAlgorithm {
+  NEAREST_KEY_MATCHING = 0,
+  STABLE_MATCHING = 1,
+  LSH_MATCHING = 2,
+  HANDSHAKE_MATCHING = 3,
+  AGE_MIXING_MATCHING = 4
+};
+
+// Pairs seekers with the algorithm chosen by the MATCHING parameter
+struct Matcher {
+  unsigned algorithm;
+  unsigned neighbourhood;
+  unsigned candidates;
+  unsigned threads;
+  double bucket_width;
+  unsigned rounds;
+  // Partner age band by male age band
+  std::vector<sim::alias_table<> > mixing;
+
+  void init(const ParameterMap& parameters)
+  {
+    algorithm = parameters.at("MATCHING");
+    neighbourhood = parameters.at("MATCH_NEIGHBOURHOOD");
+    candidates = parameters.at("STABLE_MATCH_CANDIDATES");
+    threads = parameters.at("MATCH_THREADS");
+    bucket_width = parameters.at("LSH_BUCKET_WIDTH");
+    rounds = parameters.at("HANDSHAKE_ROUNDS");
+    init_mixing(parameters);
+  }
+
+  void match(Population& population, const MatchingSpace& space,
+	     HandleVector seekers[2]) const
+  {
+    if (algorithm == STABLE_MATCHING)
+      stable_match(population, space, seekers, neighbourhood, candidates,
+		   threads);
+    else if (algorithm == LSH_MATCHING)
+      lsh_match(population, space, seekers, neighbourhood, bucket_width);
+    else if (algorithm == HANDSHAKE_MATCHING)
+      handshake_match(population, space, seekers, neighbourhood, rounds,
+		      threads);
+    else if (algorithm == AGE_MIXING_MATCHING)
+      age_mixing_match(population, space, seekers, mixing, neighbourhood);
+    else
+      nearest_key_match(population, space, seekers, neighbourhood);
+  }
+
+  /*
+    The chance that a male in one age band partners a female in another
+    is proportional to a normal density, with standard deviation
+    AGE_MIXING_SD, in the difference of their bands' mid ages less
+    AGE_MIXING_GAP.
+  */
+  void init_mixing(const ParameterMap& parameters)
+  {
+    unsigned bands = parameters.at("AGE_MIXING_BANDS");
+    double width = (parameters.at("EXIT_AGE") - parameters.at("ENTRY_AGE")) /
+      bands;
+    double gap = parameters.at("AGE_MIXING_GAP");
+    double sd = parameters.at("AGE_MIXING_SD");
+    mixing.resize(bands);
+    std::vector<double> weights(bands);
+    for (unsigned i = 0; i < bands; ++i) {
+      for (unsigned j = 0; j < bands; ++j) {
+	double z = ((double) i - j) * width - gap;
+	weights[j] = exp(-0.5 * z * z / (sd * sd));
+      }
+      mixing[i].init(weights);
+    }
+  }
+};
+
+/*
+  Alternative to nearest_key_match() in which seekers who aren't matched
+  straight away wait for a partner, for up to lifetime, in a pool for
+  their sex ordered by matching key. Each new seeker takes the nearest
+  waiting seeker of the opposite sex who isn't already a partner from
+  among the neighbourhood on either side of its key, or else joins its
+  own pool. The pools are updated incrementally, so the work per step is
+  proportional to the number of new seekers and expiries rather than to
+  the number waiting. Waiting agents who die are dropped when they are
+  come across, so engines have to forget() a handle before reusing it.
+*/
+class SeekerPool {
+public:
+  SeekerPool(const double lifetime, const unsigned neighbourhood)
+    : lifetime(lifetime), neighbourhood(neighbourhood) { }
+
+  void match(Population& population, const MatchingSpace& space,
+	     const HandleVector seekers[2], const double now)
+  {
+    expire(now);
+    // Alternate between the sexes so that neither always finds the other's
+    // new seekers already waiting
+    size_t n = std::max(seekers[MALE].size(), seekers[FEMALE].size());
+    for (size_t i = 0; i < n; ++i)
+      for (unsigned s = 0; s < 2; ++s)
+	if (i < seekers[s].size())
+	  seek(population, space, population[seekers[s][i]], now);
+  }
+
+  // Drops the agent with the given handle, if waiting, before the handle
+  // is reused
+  void forget(const AgentHandle handle)
+  {
+    if (handle < entries.size() && entries[handle].expiry > 0.0)
+      leave(handle);
+  }
+
+  // Matches a single seeker, for engines that handle seekers one by one
+  void match(Population& population, const MatchingSpace& space,
+	     Agent& agent, const double now)
+  {
+    expire(now);
+    seek(population, space, agent, now);
+  }
+
+private:
+  typedef std::set<std::pair<uint64_t, AgentHandle> > Pool;
+
+  struct Waiting {
+    double expiry;
+    uint64_t key;
+    AgentHandle handle;
+    Sex sex;
+  };
+
+  double lifetime;
+  unsigned neighbourhood;
+  Pool pools[2];
+  // Queued in order of expiry. Entries of agents who have since been
+  // matched, or who have started waiting again, are stale.
+  std::deque<Waiting> queue;
+  // Current entry of each agent by handle, with expiry 0 if not waiting
+  std::vector<Waiting> entries;
+
+  void leave(const AgentHandle handle)
+  {
+    Waiting& entry = entries[handle];
+    pools[entry.sex].erase(std::make_pair(entry.key, handle));
+    entry.expiry = 0.0;
+  }
+
+  void expire(const double now)
+  {
+    while (queue.size() > 0 && queue.front().expiry <= now) {
+      if (entries[queue.front().handle].expiry == queue.front().expiry)
+	leave(queue.front().handle);
+      queue.pop_front();
+    }
+  }
+
+  void seek(Population& population, const MatchingSpace& space,
+	    Agent& agent, const double now)
+  {
+    Pool& pool = pools[1 - agent.sex];
+    uint64_t key = space.key(agent);
+    Pool::iterator position = pool.lower_bound(std::make_pair(key, 0));
+    AgentHandle best = NO_HANDLE;
+    double best_distance = std::numeric_limits<double>::max();
+    HandleVector dead;
+    auto consider = [&](const AgentHandle handle) {
+      if (!population.is_alive(handle))
+	dead.push_back(handle);
+      else if (std::find(agent.partners.begin(), agent.partners.end(),
+			 handle) == agent.partners.end()) {
+	double d = space.distance(agent, population[handle]);
+	if (d < best_distance) {
+	  best_distance = d;
+	  best = handle;
+	}
+      }
+    };
+    Pool::iterator it = position;
+    for (unsigned j = 0; j < neighbourhood && it != pool.end(); ++j, ++it)
+      consider(it->second);
+    it = position;
+    for (unsigned j = 0; j < neighbourhood && it != pool.begin(); ++j)
+      consider((--it)->second);
+    for (auto& handle: dead)
+      leave(handle);
+
+    if (agent.id >= entries.size())
+      entries.resize(agent.id + 1, Waiting{0.0, 0, NO_HANDLE, MALE});
+    if (entries[agent.id].expiry > 0.0)
+      leave(agent.id);
+    if (best != NO_HANDLE) {
+      leave(best);
+      population.form_partnership(agent, population[best]);
+    } else {
+      Waiting entry = {now + lifetime, key, agent.id, agent.sex};
+      entries[agent.id] = entry;
+      pools[agent.sex].insert(std::make_pair(key, agent.id));
+      queue.push_back(entry);
+    }
+  }
+};
+
+struct SexAct {
+  AgentHandle agent;
+  AgentHandle partner;
+  bool condom;
+};
+
+/*
+  Per act probability of HIV transmission, indexed by the infected partner's
+  HIV stage, the receiving partner's sex, whether a condom was used and
+  whether the infected partner is on ART. It is precomputed from the per act
+  risk in chronic infection, stage multipliers for primary and late (CDC
+  stage 4) infection, and condom and ART efficacy.
+*/
+class TransmissionTable {
+public:
+  void init(const ParameterMap& parameters)
+  {
+    const double stage_multiplier[6] = {
+      0.0,
+      parameters.at("ACUTE_INFECTIOUSNESS"),
+      1.0,
+      1.0,
+      1.0,
+      parameters.at("LATE_INFECTIOUSNESS")
+    };
+    const double act_risk[2] = {
+      parameters.at("ACT_RISK_MALE"),
+      parameters.at("ACT_RISK_FEMALE")
+    };
+    double condom_efficacy = parameters.at("CONDOM_EFFICACY");
+    double art_efficacy = parameters.at("ART_EFFICACY");
+    for (unsigned stage = 0; stage < 6; ++stage)
+      for (unsigned sex = 0; sex < 2; ++sex)
+	for (unsigned condom = 0; condom < 2; ++condom)
+	  for (unsigned art = 0; art < 2; ++art)
+	    risk[index(stage, sex, condom, art)] =
+	      std::min(1.0, act_risk[sex] * stage_multiplier[stage]) *
+	      (condom ? 1.0 - condom_efficacy : 1.0) *
+	      (art ? 1.0 - art_efficacy : 1.0);
+  }
+
+  double operator()(const unsigned stage, const Sex receiver,
+		    const bool condom, const bool art) const
+  {
+    return risk[index(stage, receiver, condom, art)];
+  }
+
+private:
+  double risk[6 * 2 * 2 * 2];
+
+  static unsigned index(const unsigned stage, const unsigned sex,
+			const unsigned condom, const unsigned art)
+  {
+    return ((stage * 2 + sex) * 2 + condom) * 2 + art;
+  }
+};
+
+// Proportion of the people an agent represents who are exposed through a
+// partnership with an agent representing fewer people
+static inline double exposure(const Agent& source, const Agent& receiver)
+{
+  return source.weight < receiver.weight ?
+    (double) source.weight / receiver.weight : 1.0;
+}
+
+/*
+  Evaluates HIV transmission for all the sex acts of a step in one pass.
+  Infections only take effect once all acts have been evaluated, so agents
+  infected on this step don't transmit on it too. Acts are queued before
+  the step's deaths and exits, so those with an agent who has since left
+  the model are dropped. Returns the number of new infections.
+*/
+static unsigned transmission_events(Population& population,
+				    const TransmissionTable& table,
+				    const std::vector<SexAct>& acts,
+				    const double date)
+{
+  // Infected agents and their infecting partners
+  std::vector<std::pair<AgentHandle, AgentHandle> > infected;
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  for (auto& act: acts) {
+    const Agent& agent = population[act.agent];
+    const Agent& partner = population[act.partner];
+    if (!agent.alive || !partner.alive)
+      continue;
+    population.log.write(LOG_ACT, act.agent, act.partner, act.condom);
+    if ((agent.hiv > 0) == (partner.hiv > 0))
+      continue;
+    const Agent& source = agent.hiv > 0 ? agent : partner;
+    const Agent& receiver = agent.hiv > 0 ? partner : agent;
+    if (uniform(rng) < table(source.hiv, receiver.sex, act.condom, source.art) *
+	exposure(source, receiver))
+      infected.push_back(std::make_pair(receiver.id, source.id));
+  }
+  unsigned infections = 0;
+  for (auto& infection: infected) {
+    Agent& agent = population[infection.first];
+    if (agent.hiv == 0) {
+      agent.hiv = 1;
+      population.new_infections[agent.sex] += agent.weight;
+      population.log.write(LOG_INFECTION, agent.id, infection.second);
+      population.transmissions.record(infection.second, agent.id, date,
+				      population[infection.second].hiv);
+      ++infections;
+    }
+  }
+  return infections;
+}
+
+/*
+  Draws the number of partners an agent has once the network has settled.
+  The agent's number of partners is treated as a birth-death chain: it
+  gains partners at its partner forming rate while single and at its
+  concurrency rate over its number of partners otherwise, and loses them
+  through its own breakups (relationship stickiness over its number of
+  partners) and each partner's, at the mean stickiness of partnered
+  agents. Matching is assumed to succeed. Fills weights with the
+  unnormalised distribution and returns its total.
+*/
+static double equilibrium_partners(const Agent& agent,
+				   const double mean_stickiness,
+				   double weights[MAX_INITIAL_PARTNERS + 1])
+{
+  double total = weights[0] = 1.0;
+  for (unsigned n = 1; n <= MAX_INITIAL_PARTNERS; ++n) {
+    double gain = n == 1 ? agent.partner_forming_attribute :
+      agent.concurrency_attribute / (n - 1);
+    double loss = agent.relationship_stickiness_attribute / n +
+      n * mean_stickiness;
+    weights[n] = weights[n - 1] * gain / loss;
+    total += weights[n];
+  }
+  return total;
+}
+
+/*
+  Starts the population off with a partnership network close to the one
+  it would settle into, instead of with everyone single, so that runs
+  needn't burn in. Each agent is given a number of partnership "stubs"
+  drawn by equilibrium_partners(), the sex with more stubs loses its excess
+  at random, and the stubs of each sex are sorted by matching key and
+  paired in order, so that partners are close in matching space. Pairs
+  that would repeat a partnership are dropped.
+*/
+static void initialize_partnerships(Population& population,
+				    const ParameterMap& parameters)
+{
+  MatchingSpace space;
+  space.init(parameters);
+  double weights[MAX_INITIAL_PARTNERS + 1];
+
+  // Less sticky agents are partnered more, so the mean stickiness of
+  // partners is estimated from the expected numbers of partners given
+  // the population mean.
+  double mean_stickiness = 0.0;
+  for (auto& agents: population.agents)
+    for (auto& agent: agents)
+      mean_stickiness += agent.relationship_stickiness_attribute;
+  mean_stickiness /= population.size();
+  double total_partners = 0.0, total_stickiness = 0.0;
+  for (auto& agents: population.agents)
+    for (auto& agent: agents) {
+      double total = equilibrium_partners(agent, mean_stickiness, weights);
+      double expected = 0.0;
+      for (unsigned n = 1; n <= MAX_INITIAL_PARTNERS; ++n)
+	expected += n * weights[n] / total;
+      total_partners += expected;
+      total_stickiness += expected * agent.relationship_stickiness_attribute;
+    }
+  mean_stickiness = total_stickiness / total_partners;
+
+  std::vector<std::pair<uint64_t, AgentHandle> > stubs[2];
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  for (unsigned s = 0; s < 2; ++s)
+    for (auto& agent: population.agents[s]) {
+      double x = uniform(rng) *
+	equilibrium_partners(agent, mean_stickiness, weights);
+      unsigned n = 0;
+      while (n < MAX_INITIAL_PARTNERS && (x -= weights[n]) >= 0.0)
+	++n;
+      stubs[s].insert(stubs[s].end(), n,
+		      std::make_pair(space.key(agent), agent.id));
+    }
+  size_t n = std::min(stubs[MALE].size(), stubs[FEMALE].size());
+  for (auto& sex_stubs: stubs) {
+    std::shuffle(sex_stubs.begin(), sex_stubs.end(), rng);
+    sex_stubs.resize(n);
+    std::sort(sex_stubs.begin(), sex_stubs.end());
+  }
+  for (size_t i = 0; i < n; ++i) {
+    Agent& male = population[stubs[MALE][i].second];
+    AgentHandle female = stubs[FEMALE][i].second;
+    if (std::find(male.partners.begin(), male.partners.end(), female) ==
+	male.partners.end())
+      population.form_partnership(male, population[female]);
+  }
+}
+
+/*
+  The attributes drawn by Agent::init_attributes(), each from a beta
+  distribution with first shape parameter 2 and second b[sex][attribute].
+*/
+const unsigned NUM_ATTRIBUTES = 6;
+
+static double Agent::* const attribute_members[NUM_ATTRIBUTES] = {
+  &Agent::relationship_stickiness_attribute,
+  &Agent::partner_forming_attribute, &Agent::concurrency_attribute,
+  &Agent::sexual_drive_attribute, &Agent::preference_fifs_attribute,
+  &Agent::force_infection_attribute
+};
+
+struct AttributeShapes {
+  double b[2][NUM_ATTRIBUTES];
+
+  explicit AttributeShapes(const ParameterMap& parameters)
+  {
+    double time_step = parameters.at("TIME_STEP");
+    for (unsigned s = 0; s < 2; ++s) {
+      b[s][0] = parameters.at("MEAN_PARTNERSHIP_TIME") / time_step * 2.0;
+      b[s][1] = parameters.at("MEAN_TIME_UNTIL_PARTNER") / time_step * 2.0;
+      b[s][2] = parameters.at("MEAN_TIME_CONCURRENT") / time_step * 2.0;
+      b[s][3] = parameters.at("MEAN_TIME_SEX") / time_step * 2.0;
+      b[s][4] = 2.0 / parameters.at("PREFERENCE_FIFS") - 2.0;
+    }
+    b[MALE][5] = 2.0 / parameters.at("MEAN_RISK_HET_MALE_SEX") - 2.0;
+    b[FEMALE][5] = 2.0 / parameters.at("MEAN_RISK_HET_FEMALE_SEX") - 2.0;
+  }
+};
+
+/*
+  Sets the attributes of every agent with the same distributions as
+  Agent::init_attributes(), but drawn in batches, one attribute and sex at
+  a time, with sim::beta_distribution::generate().
+*/
+static void init_attributes_batched(Population& population,
+				    const ParameterMap& parameters)
+{
+  AttributeShapes shapes(parameters);
+  std::vector<double> values;
+  for (unsigned s = 0; s < 2; ++s) {
+    std::vector<Agent>& agents = population.agents[s];
+    values.resize(agents.size());
+    for (unsigned a = 0; a < NUM_ATTRIBUTES; ++a) {
+      sim::beta_distribution<>(2.0, shapes.b[s][a]).generate
+	(rng, values.data(), values.size());
+      for (size_t i = 0; i < agents.size(); ++i)
+	agents[i].*attribute_members[a] = values[i];
+    }
+    for (auto& agent: agents)
+      agent.fifs_log_q = log(1.0 - agent.preference_fifs_attribute);
+  }
+}
+
+/*
+  Sets the attributes of every agent by quasi-Monte Carlo: each agent's
+  attributes are a point of a randomised Sobol' sequence, one dimension
+  per attribute, mapped through tabulated inverse beta CDFs. The initial
+  population's attribute distribution then varies far less between
+  replicates than with independent draws.
+*/
+static void init_attributes_qmc(Population& population,
+				const ParameterMap& parameters)
+{
+  AttributeShapes shapes(parameters);
+  sim::tabulated_quantile<> quantiles[2][NUM_ATTRIBUTES];
+  for (unsigned s = 0; s < 2; ++s)
+    for (unsigned a = 0; a < NUM_ATTRIBUTES; ++a) {
+      double b = shapes.b[s][a];
+      if (s == FEMALE && b == shapes.b[MALE][a])
+	quantiles[s][a] = quantiles[MALE][a];
+      else
+	quantiles[s][a] = sim::tabulated_quantile<>
+	  ([b](double x) { return sim::beta_cdf(x, 2.0, b); }, 0.0, 1.0);
+    }
+
+  sim::sobol_sequence sobol(NUM_ATTRIBUTES, rng);
+  double point[NUM_ATTRIBUTES];
+  for (unsigned s = 0; s < 2; ++s)
+    for (auto& agent: population.agents[s]) {
+      sobol.next(point);
+      for (unsigned a = 0; a < NUM_ATTRIBUTES; ++a)
+	agent.*attribute_members[a] = quantiles[s][a](point[a]);
+      agent.fifs_log_q = log(1.0 - agent.preference_fifs_attribute);
+    }
+}
+
+void
+initialize_agents(Population& population, const unsigned num_agents,
+		  const ParameterMap parameters)
+{
+  bool batched = parameters.at("BATCH_ATTRIBUTES") != 0.0;
+  bool qmc = parameters.at("QMC_ATTRIBUTES") != 0.0;
+  for (unsigned i = 0; i < num_agents; ++i) {
+    Sex sex = random_sex();
+    AgentHandle handle = population.add(sex);
+    population[handle].init(handle, sex, parameters, !batched && !qmc);
+  }
+  if (qmc)
+    init_attributes_qmc(population, parameters);
+  else if (batched)
+    init_attributes_batched(population, parameters);
+  if (parameters.at("EQUILIBRIUM_NETWORK") != 0.0)
+    initialize_partnerships(population, parameters);
+}
+
+
+// Numbers of people, weighted by the number each agent represents, except
+// for agents, the number of living agents
+struct Prevalence {
+  unsigned agents[2] = {0, 0};
+  unsigned alive[2] = {0, 0};
+  unsigned infected[2] = {0, 0};
+  double prevalence[2];
+};
+
+static Prevalence calc_prevalence(const Population& population)
+{
+  Prevalence p;
+  for (unsigned s = 0; s < 2; ++s) {
+    for (auto& agent: population.agents[s]) {
+      p.agents[s] += agent.alive;
+      p.alive[s] += agent.alive * agent.weight;
+      p.infected[s] += (agent.alive && agent.hiv > 0) * agent.weight;
+    }
+    p.prevalence[s] = (double) p.infected[s] / p.alive[s];
+  }
+  return p;
+}
+
+// On each step of the iteration we write out CSV data
+void report_line(double date, size_t num_agents, const Prevalence& p,
+		 const unsigned hiv[6])
+{
+  std::cout << date << ", "
+	    << num_agents << ", "
+	    << p.alive[MALE] + p.alive[FEMALE] << ", "
+	    << p.infected[MALE] + p.infected[FEMALE] << ", "
+	    << (double) (p.infected[MALE] + p.infected[FEMALE]) /
+    (p.alive[MALE] + p.alive[FEMALE]) << ", "
+	    << p.alive[MALE] << ", "
+	    << p.infected[MALE] << ", "
+	    << p.prevalence[MALE] << ", "
+	    << p.alive[FEMALE] << ", "
+	    << p.infected[FEMALE] << ", "
+	    << p.prevalence[FEMALE] << ", "
+	    << hiv[0] << ", " << hiv[1] << ", " << hiv[2] << ", "
+	    << hiv[3] << ", " << hiv[4] << ", " << hiv[5]
+	    << std::endl;
+}
+
+void report(double date,  const Population& population)
+{
+  // date, num agents, num alive, num infected, num alive infected
+  Prevalence p = calc_prevalence(population);
+
+  unsigned hiv[6] = {0,0,0,0,0,0};
+  for (auto& agents: population.agents)
+    for (auto & agent: agents)
+      if (agent.alive)
+	hiv[agent.hiv] += agent.weight;
+
+  report_line(date, population.size(), p, hiv);
+}
+
+const uint32_t NO_VERTEX = std::numeric_limits<uint32_t>::max();
+
+/*
+  The partnership network of the living agents in compressed sparse row
+  form, males being vertices 0 to males - 1 and females the rest.
+*/
+struct NetworkSnapshot {
+  sim::csr_graph graph;
+  // Handle of each vertex's agent
+  HandleVector handles;
+  uint32_t males;
+
+  void build(const Population& population, const unsigned threads)
+  {
+    std::vector<uint32_t> vertex(population.slots.size(), NO_VERTEX);
+    handles.clear();
+    for (unsigned s = 0; s < 2; ++s) {
+      for (auto& agent: population.agents[s])
+	if (agent.alive) {
+	  vertex[agent.id] = handles.size();
+	  handles.push_back(agent.id);
+	}
+      if (s == MALE)
+	males = handles.size();
+    }
+    uint32_t n = handles.size();
+    graph.offsets.resize(n + 1);
+    graph.offsets[0] = 0;
+    for (uint32_t v = 0; v < n; ++v)
+      graph.offsets[v + 1] = graph.offsets[v] +
+	population[handles[v]].partners.size();
+    graph.neighbours.resize(graph.offsets[n]);
+    sim::parallel_for(n, threads,
+		      [&](size_t begin, size_t end, unsigned) {
+			for (size_t v = begin; v < end; ++v) {
+			  uint32_t k = graph.offsets[v];
+			  for (auto& partner: population[handles[v]].partners)
+			    graph.neighbours[k++] = vertex[partner];
+			}
+		      });
+  }
+};
+
+// Sums for the correlation of an attribute across partnerships
+struct Assortativity {
+  double x = 0.0, y = 0.0, xx = 0.0, yy = 0.0, xy = 0.0;
+  size_t n = 0;
+
+  void add(const double male, const double female)
+  {
+    x += male;
+    y += female;
+    xx += male * male;
+    yy += female * female;
+    xy += male * female;
+    ++n;
+  }
+
+  void add(const Assortativity& other)
+  {
+    x += other.x;
+    y += other.y;
+    xx += other.xx;
+    yy += other.yy;
+    xy += other.xy;
+    n += other.n;
+  }
+
+  // Pearson correlation between male and female partners
+  double correlation() const
+  {
+    double covariance = xy / n - (x / n) * (y / n);
+    return covariance / sqrt((xx / n - (x / n) * (x / n)) *
+			     (yy / n - (y / n) * (y / n)));
+  }
+};
+
+/*
+  Writes statistics of a snapshot of the partnership network as CSV lines
+  prefixed by "network" and the date: the number of agents and
+  partnerships, the number of agents with each number of partners, the
+  proportion with more than one partner, the number of connected
+  components of more than one agent and the size of the largest, and the
+  correlations of age and of partner forming attribute across
+  partnerships. Degrees and correlations are computed on threads threads.
+  Agents not in the population, such as aggregated singles, can be added
+  as isolates.
+*/
+static void network_report(const double date, const Population& population,
+			   const unsigned threads, const size_t isolates = 0)
+{
+  NetworkSnapshot snapshot;
+  snapshot.build(population, threads);
+  const sim::csr_graph& graph = snapshot.graph;
+  uint32_t n = graph.num_vertices();
+
+  struct Partial {
+    std::vector<size_t> degrees;
+    Assortativity age, forming;
+  };
+  std::vector<Partial> partials(std::max(1u, threads ? threads :
+					std::thread::hardware_concurrency()));
+  sim::parallel_for(n, partials.size(),
+		    [&](size_t begin, size_t end, unsigned thread) {
+		      Partial& partial = partials[thread];
+		      for (size_t v = begin; v < end; ++v) {
+			uint32_t degree = graph.degree(v);
+			if (degree >= partial.degrees.size())
+			  partial.degrees.resize(degree + 1);
+			++partial.degrees[degree];
+			if (v >= snapshot.males)
+			  continue;
+			const Agent& male = population[snapshot.handles[v]];
+			for (auto u = graph.begin(v); u != graph.end(v); ++u) {
+			  const Agent& female =
+			    population[snapshot.handles[*u]];
+			  partial.age.add(male.age, female.age);
+			  partial.forming.add(male.partner_forming_attribute,
+					      female.partner_forming_attribute);
+			}
+		      }
+		    });
+  std::vector<size_t> degrees(1, isolates);
+  Assortativity age, forming;
+  for (auto& partial: partials) {
+    if (partial.degrees.size() > degrees.size())
+      degrees.resize(partial.degrees.size());
+    for (size_t d = 0; d < partial.degrees.size(); ++d)
+      degrees[d] += partial.degrees[d];
+    age.add(partial.age);
+    forming.add(partial.forming);
+  }
+
+  sim::disjoint_sets components(n);
+  for (uint32_t v = 0; v < snapshot.males; ++v)
+    for (auto u = graph.begin(v); u != graph.end(v); ++u)
+      components.unite(v, *u);
+  size_t num_components = 0, largest = 0;
+  for (uint32_t v = 0; v < n; ++v)
+    if (components.find(v) == v && components.set_size(v) > 1) {
+      ++num_components;
+      largest = std::max<size_t>(largest, components.set_size(v));
+    }
+
+  size_t agents = n + isolates, concurrent = 0;
+  for (size_t d = 2; d < degrees.size(); ++d)
+    concurrent += degrees[d];
+  std::ostringstream prefix_stream;
+  prefix_stream << "network," << date << ",";
+  std::string prefix = prefix_stream.str();
+  std::cout << prefix << "agents," << agents << std::endl;
+  std::cout << prefix << "partnerships," << graph.num_edges() << std::endl;
+  for (size_t d = 0; d < degrees.size(); ++d)
+    std::cout << prefix << "degree " << d << "," << degrees[d] << std::endl;
+  std::cout << prefix << "concurrency," << (double) concurrent / agents
+	    << std::endl;
+  std::cout << prefix << "components," << num_components << std::endl;
+  std::cout << prefix << "largest component," << largest << std::endl;
+  std::cout << prefix << "age assortativity," << age.correlation()
+	    << std::endl;
+  std::cout << prefix << "forming assortativity," << forming.correlation()
+	    << std::endl;
+}
+
+void summary(const unsigned sim_no, const char* description,
+	     const Population& population, ParameterMap &outputs)
+{
+  unsigned alive[2] = {0, 0}, infected[2] = {0, 0};
+  std::vector<unsigned> hiv(6);
+  double avg_age = 0.0;
+  double youngest = std::numeric_limits<double>::max();
+  double oldest = 0.0;
+  unsigned partnerships = 0, concurrent = 0;
+  for (unsigned s = 0; s < 2; ++s) {
+    for (auto& agent: population.agents[s]) {
+      if (!agent.alive)
+	continue;
+      hiv[agent.hiv] += agent.weight;
+      alive[s] += agent.weight;
+      if (agent.hiv > 0) infected[s] += agent.weight;
+      avg_age += agent.age * agent.weight;
+      partnerships += agent.partners.size() * agent.weight;
+      if (agent.partners.size() > 1) concurrent += agent.weight;
+      if (agent.age > oldest) oldest = agent.age;
+      if (agent.age < youngest) youngest = agent.age;
+    }
+  }
+  unsigned males = alive[MALE], females = alive[FEMALE];
+  unsigned hiv_males = infected[MALE], hiv_females = infected[FEMALE];
+  std::ostringstream prefix_stream;
+  prefix_stream << "summary," << sim_no << "," << description << ",";
+  std::string prefix = prefix_stream.str();
+  std::cout << prefix
+	    << "males: " << males << std::endl;
+  std::cout << prefix
+	    << "females," << females << std::endl;
+  std::cout << prefix
+	    << "youngest," << youngest << std::endl;
+  std::cout << prefix
+	    << "oldest," << oldest << std::endl;
+  std::cout << prefix
+	    << "Average age," << avg_age / (males + females) << std::endl;
+  for (size_t i = 0; i < 6; ++i)
+    std::cout << prefix << "HIV " << i << " " << hiv[i] << std::endl;
+  std::cout << prefix
+	    << "Partnerships," << partnerships / 2 << std::endl;
+  std::cout << prefix
+	    << "Concurrent," << concurrent << std::endl;
+  std::cout << prefix
+	    << "Male prevalence: " << (double) hiv_males / males << std::endl;
+  std::cout << prefix
+	    << "Female prevalence: " << (double) hiv_females / females
+	    << std::endl;
+  // Incidence since the last summary: new infections over the people who
+  // were susceptible then
+  if(outputs.find("SUSCEPTIBLE_MALES") != outputs.end()) {
+    double new_males = population.new_infections[MALE] -
+      outputs.at("INFECTIONS_MALES");
+    double new_females = population.new_infections[FEMALE] -
+      outputs.at("INFECTIONS_FEMALES");
+    double susceptible_males = outputs.at("SUSCEPTIBLE_MALES");
+    double susceptible_females = outputs.at("SUSCEPTIBLE_FEMALES");
+    std::cout << prefix
+	      << "Male incidence: " << new_males / susceptible_males
+	      << std::endl;
+    std::cout << prefix
+	      << "Female incidence: " << new_females / susceptible_females
+	      << std::endl;
+    std::cout << prefix
+	      << "Incidence: " << (new_males + new_females) /
+      (susceptible_males + susceptible_females) << std::endl;
+  }
+  outputs["SUSCEPTIBLE_MALES"] = males - hiv_males;
+  outputs["SUSCEPTIBLE_FEMALES"] = females - hiv_females;
+  outputs["INFECTIONS_MALES"] = population.new_infections[MALE];
+  outputs["INFECTIONS_FEMALES"] = population.new_infections[FEMALE];
+}
+
+// New entrants take over the slots of agents who died or left the model.
+// The engines compact away whatever isn't reused once it makes up more than
+// COMPACTION_THRESHOLD of the population, so that the event loops aren't
+// forever skipping over dead agents.
+static void entry_events(Population& population, const unsigned num_entries,
+			 const ParameterMap& parameters)
+{
+  for (unsigned i = 0; i < num_entries; ++i) {
+    Sex sex = random_sex();
+    AgentHandle handle = population.add(sex);
+    population[handle].entry(handle, sex, parameters);
+  }
+}
+
+// Annual mortality rates indexed by HIV stage
+static void mortality_rates(const ParameterMap& parameters, double rates[6])
+{
+  rates[0] = parameters.at("MORTALITY_HIV_NEGATIVE");
+  rates[1] = parameters.at("MORTALITY_HIV_PRIMARY");
+  rates[2] = parameters.at("MORTALITY_CDC_1");
+  rates[3] = parameters.at("MORTALITY_CDC_2");
+  rates[4] = parameters.at("MORTALITY_CDC_3");
+  rates[5] = parameters.at("MORTALITY_CDC_4");
+}
+
+/*
+  Event classes can run less often than every TIME_STEP: sex (and
+  infection) every SEX_TIME_STEP, partnership breakup and formation every
+  PARTNERSHIP_TIME_STEP, stage advance and starting ART every
+  STAGE_TIME_STEP, and mortality, ageing and entry every
+  DEMOGRAPHY_TIME_STEP. Each is rounded to a whole number of TIME_STEPs,
+  and the per TIME_STEP probabilities are scaled up to cover them, so that
+  coarse events don't have to visit the population every TIME_STEP.
+*/
+static unsigned steps_per_event(const ParameterMap& parameters,
+				const char *event_time_step)
+{
+  return std::max(1.0, round(parameters.at(event_time_step) /
+			     parameters.at("TIME_STEP")));
+}
+
+// TIME_STEPs between network reports, or 0 for none
+static unsigned network_interval(const ParameterMap& parameters)
+{
+  return parameters.at("NETWORK_INTERVAL") > 0.0 ?
+    steps_per_event(parameters, "NETWORK_INTERVAL") : 0;
+}
+
+// TIME_STEPs between rebuilds of the tracked components, or 0 if they
+// aren't tracked
+static unsigned component_interval(const ParameterMap& parameters)
+{
+  return parameters.at("TRACK_COMPONENTS") != 0.0 ?
+    steps_per_event(parameters, "COMPONENT_REBUILD_INTERVAL") : 0;
+}
+
+// Rebuilds the tracked components when due, and if write is set writes a
+// CSV line of the number of components and the size of the largest
+static void component_report(const double date, Population& population,
+			     const unsigned step, const unsigned rebuild_steps,
+			     const bool write)
+{
+  ComponentTracker& components = population.components;
+  if (step % rebuild_steps == 0 || !components.enabled) {
+    components.enabled = true;
+    components.rebuild(population.agents, population.slots.size());
+  }
+  if (write)
+    std::cout << "components," << date << "," << components.count() << ","
+	      << components.largest() << std::endl;
+}
+
+// End of run statistics compared across runs by the benchmarks, and
+// sampled during burn-in
+struct RunStatistics {
+  double seconds;
+  double prevalence;
+  // Per living person
+  double partnerships;
+  // Proportion of living people with more than one partner
+  double concurrency;
+};
+
+// Statistics of the individuals in the population, together with the
+// given numbers of people, and of infected people, represented by single
+// agents held outside it
+static RunStatistics run_statistics(const Population& population,
+				    const unsigned singles = 0,
+				    const unsigned infected_singles = 0)
+{
+  RunStatistics statistics;
+  unsigned alive = singles, infected = infected_singles, partners = 0;
+  unsigned concurrent = 0;
+  for (auto& agents: population.agents)
+    for (auto& agent: agents)
+      if (agent.alive) {
+	alive += agent.weight;
+	infected += (agent.hiv > 0) * agent.weight;
+	partners += agent.partners.size() * agent.weight;
+	concurrent += (agent.partners.size() > 1) * agent.weight;
+      }
+  statistics.prevalence = (double) infected / alive;
+  statistics.partnerships = 0.5 * partners / alive;
+  statistics.concurrency = (double) concurrent / alive;
+  return statistics;
+}
+
+/*
+  Steps through every agent every TIME_STEP (or every event class time
+  step). The engine keeps its matcher, seeker pool and step count between
+  calls to run(), so a run can be continued, as burn-in does, without
+  restarting the event class schedules.
+*/
+class TimeStepSimulation {
+public:
+  TimeStepSimulation(Population& p, const ParameterMap& parameters) :
+    population(p), parameters(parameters), step(0), first_step(0),
+    burning_in(false)
+  {
+    time_step = parameters.at("TIME_STEP");
+    start_date = parameters.at("START_DATE");
+    exit_age = parameters.at("EXIT_AGE");
+    entry_rate = parameters.at("ENTRY_RATE");
+    compaction_threshold = parameters.at("COMPACTION_THRESHOLD");
+    reorder_steps =
+      std::max(1.0, round(parameters.at("REORDER_INTERVAL") / time_step));
+    matcher.init(parameters);
+    if (parameters.at("SEEKER_POOL") != 0.0)
+      pool.reset(new SeekerPool(parameters.at("SEEKER_EXPIRY"),
+				parameters.at("MATCH_NEIGHBOURHOOD")));
+    per_act_transmission = parameters.at("PER_ACT_TRANSMISSION") != 0.0;
+    write_report = parameters.at("REPORT") != 0.0;
+    network_steps = network_interval(parameters);
+    network_threads = parameters.at("NETWORK_THREADS");
+    component_steps = component_interval(parameters);
+    condom_dist = std::bernoulli_distribution(parameters.at("CONDOM_USE"));
+
+    sex_steps = steps_per_event(parameters, "SEX_TIME_STEP");
+    partnership_steps = steps_per_event(parameters, "PARTNERSHIP_TIME_STEP");
+    stage_steps = steps_per_event(parameters, "STAGE_TIME_STEP");
+    demography_steps = steps_per_event(parameters, "DEMOGRAPHY_TIME_STEP");
+
+    prob_leave_acute_infection =
+      scale_probability(parameters.at("LEAVE_ACUTE_INFECTION"), stage_steps);
+    prob_start_art = 1.0 - exp(-parameters.at("ART_INITIATION_RATE") *
+			       time_step * stage_steps);
+    // Annual mortality rates by HIV stage converted to probabilities per step
+    mortality_rates(parameters, prob_death);
+    for (unsigned i = 0; i < 6; ++i)
+      prob_death[i] = 1.0 - exp(-prob_death[i] * time_step * demography_steps);
+
+    space.init(parameters);
+    transmission_table.init(parameters);
+  }
+
+  // Nothing is reported while burning in, and dates restart from
+  // START_DATE once burn-in ends
+  void set_burning_in(const bool b)
+  {
+    burning_in = b;
+    if (!b)
+      first_step = step;
+  }
+
+  RunStatistics statistics() const
+  {
+    return run_statistics(population);
+  }
+
+  // Agents are always simulated individually, so there's nothing to hand
+  // back
+  void finish() {}
+
+  // Runs for the given number of TIME_STEPs, carrying on from the last run
+  void run(const unsigned steps)
+  {
+    for (unsigned last = step + steps; step < last; ++step) {
+      if (step % reorder_steps == 0)
+	population.reorder(space);
+
+      bool sex_due = step % sex_steps == 0;
+      bool partnership_due = step % partnership_steps == 0;
+      bool stage_due = step % stage_steps == 0;
+      bool demography_due = step % demography_steps == 0;
+
+      double date = start_date + time_step * (step - first_step);
+      population.log.time = date;
+      Prevalence p = calc_prevalence(population);
+
+      acts.clear();
+      for (unsigned s = 0; s < 2; ++s) {
+	double partner_prevalence = p.prevalence[1 - s];
+	seekers[s].clear();
+	for (auto & agent: population.agents[s]) {
+	  if (!agent.alive)
+	    continue;
+	  unsigned hiv = agent.hiv;
+	  bool art = agent.art;
+	  if (partnership_due) {
+	    if (agent.breakup_event(partnership_steps))
+	      population.dissolve_partnership(agent, agent.partners.back());
+	    if (agent.seek_partner_event(partnership_steps))
+	      seekers[s].push_back(agent.id);
+	  }
+	  if (sex_due) {
+	    if (per_act_transmission) {
+	      unsigned num_acts = agent.sex_event(sex_steps);
+	      for (unsigned j = 0; j < num_acts; ++j)
+		acts.push_back({agent.id,
+				agent.partners[agent.choose_partner()],
+				condom_dist(rng)});
+	    } else if (agent.simple_infection_event(partner_prevalence,
+						    sex_steps)) {
+	      population.new_infections[s] += agent.weight;
+	    }
+	  }
+	  if (stage_due) {
+	    agent.stage_advance_event(prob_leave_acute_infection);
+	    agent.art_event(prob_start_art);
+	  }
+	  population.log.changes(agent, hiv, art);
+	  if (demography_due) {
+	    agent.mortality_event(prob_death);
+	    if (agent.alive)
+	      agent.age_event(time_step * demography_steps, exit_age);
+	    if (!agent.alive) {
+	      population.remove(agent);
+	      removed.push_back(agent.id);
+	    }
+	  }
+	}
+      }
+
+      if (partnership_due) {
+	for (auto& sex_seekers: seekers)
+	  sex_seekers.erase(std::remove_if(sex_seekers.begin(),
+					   sex_seekers.end(),
+					   [this](const AgentHandle h) {
+					     return !population[h].alive;
+					   }),
+			    sex_seekers.end());
+	// The pool's expiries run on the engine's own clock, which unlike
+	// the date doesn't go back when burn-in ends
+	if (pool)
+	  pool->match(population, space, seekers, time_step * step);
+	else
+	  matcher.match(population, space, seekers);
+      }
+      if (sex_due)
+	transmission_events(population, transmission_table, acts, date);
+
+      // Nothing refers to the dead any more, bar the seeker pool
+      for (auto& handle: removed) {
+	if (pool)
+	  pool->forget(handle);
+	population.recycle(population[handle]);
+      }
+      removed.clear();
+
+      if (demography_due) {
+	unsigned num_entries = std::poisson_distribution<unsigned>
+	  (entry_rate * (p.agents[MALE] + p.agents[FEMALE]) * time_step *
+	   demography_steps)(rng);
+	entry_events(population, num_entries, parameters);
+	if (population.num_free() > compaction_threshold * population.size())
+	  population.compact();
+      }
+
+      if (write_report && !burning_in)
+	report(date, population);
+      if (network_steps && !burning_in &&
+	  (step - first_step) % network_steps == 0)
+	network_report(date, population, network_threads);
+      if (component_steps)
+	component_report(date, population, step, component_steps,
+			 write_report && !burning_in);
+    }
+  }
+
+private:
+  Population& population;
+  const ParameterMap& parameters;
+  MatchingSpace space;
+  TransmissionTable transmission_table;
+  Matcher matcher;
+  std::unique_ptr<SeekerPool> pool;
+  HandleVector seekers[2], removed;
+  std::vector<SexAct> acts;
+  std::bernoulli_distribution condom_dist;
+  double time_step, start_date, exit_age, entry_rate, compaction_threshold;
+  unsigned reorder_steps, network_steps, network_threads, component_steps;
+  unsigned sex_steps, partnership_steps, stage_steps, demography_steps;
+  bool per_act_transmission, write_report;
+  double prob_leave_acute_infection, prob_start_art, prob_death[6];
+  // TIME_STEPs run so far, and the one on which the measured phase began
+  unsigned step, first_step;
+  bool burning_in;
+};
+
+/*
+  Continuous time alternative to stepping through every agent every
+  TIME_STEP. Each agent's events (breakup, seeking a partner, sex,
+  infection, stage advance, starting ART, death and leaving the model at
+  EXIT_AGE) are competing exponential clocks, with rates derived from the
+  same per step probabilities the time step engine uses. Only the time of
+  each agent's next event is kept, in a priority queue indexed by handle,
+  and an agent is rescheduled whenever its own or a partner's event changes
+  its rates.
+
+  Seekers go through a SeekerPool with a lifetime of TIME_STEP, as in the
+  time step engine with SEEKER_POOL set. Ages are kept as birth times and
+  only brought up to date for agents whose events fire and before reports,
+  and prevalence is counted as agents enter, leave and are infected, so
+  nothing visits every agent every TIME_STEP. In the prevalence based
+  model the infection clocks run at the rate for an upper bound on partner
+  prevalence, and infections are accepted in proportion to the actual
+  prevalence when they fire. Susceptible agents only have to be
+  rescheduled when the bound moves, which is when prevalence passes it or
+  falls below a quarter of it. In the per act model only agents with a
+  partner of different HIV status have sex clocks, since other acts can't
+  transmit. The other agents' acts are only drawn for the event log, once
+  a TIME_STEP and from a random number stream of their own, so that
+  logging doesn't change the simulation. Entries, compaction and reports
+  still happen every TIME_STEP so that outputs line up with the time step
+  engine's. The queue, seeker pools and clock are kept
+  between calls to run().
+*/
+class NextEventSimulation {
+public:
+  NextEventSimulation(Population& p, const ParameterMap& parameters) :
+    population(p), parameters(parameters), step(0), first_step(0),
+    burning_in(false), now(0.0)
+  {
+    time_step = parameters.at("TIME_STEP");
+    start_date = parameters.at("START_DATE");
+    exit_age = parameters.at("EXIT_AGE");
+    entry_rate = parameters.at("ENTRY_RATE");
+    compaction_threshold = parameters.at("COMPACTION_THRESHOLD");
+    reorder_steps =
+      std::max(1.0, round(parameters.at("REORDER_INTERVAL") / time_step));
+    per_act_transmission = parameters.at("PER_ACT_TRANSMISSION") != 0.0;
+    write_report = parameters.at("REPORT") != 0.0;
+    network_steps = network_interval(parameters);
+    network_threads = parameters.at("NETWORK_THREADS");
+    component_steps = component_interval(parameters);
+    condom_use = parameters.at("CONDOM_USE");
+    leave_acute_rate = rate(parameters.at("LEAVE_ACUTE_INFECTION"));
+    art_rate = parameters.at("ART_INITIATION_RATE");
+    mortality_rates(parameters, death_rates);
+    space.init(parameters);
+    transmission_table.init(parameters);
+    pool.reset(new SeekerPool(time_step,
+			      parameters.at("MATCH_NEIGHBOURHOOD")));
+    std::seed_seq log_seed = {(unsigned) parameters.at("SEED"), 1u};
+    log_rng.seed(log_seed);
+
+    counts = calc_prevalence(population);
+    update_prevalence();
+    for (auto& agents: population.agents)
+      for (auto& agent: agents)
+	if (agent.alive)
+	  enter(agent);
+  }
+
+  // Nothing is reported while burning in, and dates restart from
+  // START_DATE once burn-in ends
+  void set_burning_in(const bool b)
+  {
+    burning_in = b;
+    if (!b)
+      first_step = step;
+  }
+
+  RunStatistics statistics() const
+  {
+    return run_statistics(population);
+  }
+
+  // Agents are always simulated individually, so there's nothing to hand
+  // back
+  void finish() {}
+
+  // Runs for the given number of TIME_STEPs, carrying on from the last
+  // run, and leaves every agent's age up to date
+  void run(const unsigned steps)
+  {
+    for (unsigned last = step + steps; step < last; ++step) {
+      if (step % reorder_steps == 0)
+	population.reorder(space);
+      now = step * time_step;
+      double step_date = date(now);
+      population.log.time = step_date;
+      begin_step();
+      double step_end = (step + 1) * time_step;
+      // Rounded to the nearest tick, times late in the step could be logged
+      // as the next step's, so they're kept a tick and a half before it
+      double last_log_time = date(step_end) - 1.5 * population.log.tick();
+      while (!queue.empty() && queue.top_priority() < step_end) {
+	now = queue.top_priority();
+	population.log.time = std::min(date(now), last_log_time);
+	fire(population[queue.top()]);
+      }
+      now = step_end;
+      bool network_due = network_steps && !burning_in &&
+	(step - first_step) % network_steps == 0;
+      if ((write_report && !burning_in) || network_due)
+	update_ages();
+      if (write_report && !burning_in)
+	report(step_date, population);
+      if (network_due)
+	network_report(step_date, population, network_threads);
+      if (component_steps)
+	component_report(step_date, population, step, component_steps,
+			 write_report && !burning_in);
+    }
+    update_ages();
+  }
+
+private:
+  enum Event {
+    BREAKUP,
+    SEEK_PARTNER,
+    SEX,
+    INFECTION,
+    STAGE_ADVANCE,
+    START_ART,
+    DEATH,
+    NUM_EVENTS
+  };
+
+  // Lowest upper bound on partner prevalence used for infection clocks
+  static constexpr double MIN_PREVALENCE_BOUND = 0.01;
+
+  Population& population;
+  const ParameterMap& parameters;
+  MatchingSpace space;
+  TransmissionTable transmission_table;
+  sim::indexed_priority_queue<double> queue;
+  std::unique_ptr<SeekerPool> pool;
+  double time_step, start_date, exit_age, entry_rate, compaction_threshold;
+  unsigned reorder_steps, network_steps, network_threads;
+  unsigned component_steps;
+  bool per_act_transmission, write_report;
+  // Draws the acts that are only logged
+  std::mt19937 log_rng;
+  double condom_use, leave_acute_rate, art_rate, death_rates[6];
+  // Numbers of agents, living people and infected people by sex
+  Prevalence counts;
+  // Partner prevalence by sex, and the bound infection clocks run at
+  double partner_prevalence[2], prevalence_bound[2];
+  // Time at which each agent, by handle, was aged 0
+  std::vector<double> birth;
+  // Whether each agent, by handle, was last scheduled with a sex clock
+  std::vector<bool> sex_clock;
+  // TIME_STEPs run so far, and the one on which the measured phase began
+  unsigned step, first_step;
+  bool burning_in;
+  // Current time in years since the engine started
+  double now;
+
+  // Date of a time on the engine's clock
+  double date(const double t) const
+  {
+    return start_date + t - first_step * time_step;
+  }
+
+  // Converts the probability of an event per TIME_STEP to an annual rate
+  double rate(const double prob) const
+  {
+    return -log1p(-std::min(prob, 1.0 - 1e-12)) / time_step;
+  }
+
+  double infection_rate(const Agent& agent, const double prevalence) const
+  {
+    return rate(agent.force_infection_attribute *
+		agent.partner_forming_attribute * prevalence);
+  }
+
+  // Whether any of the agent's partners has a different HIV status
+  bool discordant(const Agent& agent) const
+  {
+    for (auto& partner: agent.partners)
+      if ((population[partner].hiv > 0) != (agent.hiv > 0))
+	return true;
+    return false;
+  }
+
+  void rates(const Agent& agent, double r[NUM_EVENTS]) const
+  {
+    unsigned n = agent.partners.size();
+    r[BREAKUP] = n > 0 ? rate(agent.relationship_stickiness_attribute / n) :
+      0.0;
+    r[SEEK_PARTNER] = rate(n == 0 ? agent.partner_forming_attribute :
+			   agent.concurrency_attribute / n);
+    // The time step engine has sex at most once per step, so its expected
+    // number of acts, rather than the chance of any, is matched
+    r[SEX] = n > 0 && per_act_transmission && discordant(agent) ?
+      agent.sexual_drive_attribute / time_step : 0.0;
+    r[INFECTION] = agent.hiv == 0 && !per_act_transmission ?
+      infection_rate(agent, prevalence_bound[agent.sex]) : 0.0;
+    r[STAGE_ADVANCE] = agent.hiv == 1 ? leave_acute_rate : 0.0;
+    r[START_ART] = agent.hiv > 1 && !agent.art ? art_rate : 0.0;
+    r[DEATH] = death_rates[agent.hiv];
+  }
+
+  double exit_time(const Agent& agent) const
+  {
+    return birth[agent.id] + exit_age;
+  }
+
+  void update_ages()
+  {
+    for (auto& agents: population.agents)
+      for (auto& agent: agents)
+	if (agent.alive)
+	  agent.age = now - birth[agent.id];
+  }
+
+  // Starts keeping track of a new or initial agent
+  void enter(const Agent& agent)
+  {
+    if (agent.id >= birth.size()) {
+      birth.resize(agent.id + 1);
+      sex_clock.resize(agent.id + 1);
+    }
+    birth[agent.id] = now - agent.age;
+    schedule(agent);
+  }
+
+  void schedule(const Agent& agent)
+  {
+    double r[NUM_EVENTS], total = 0.0;
+    rates(agent, r);
+    for (unsigned e = 0; e < NUM_EVENTS; ++e)
+      total += r[e];
+    sex_clock[agent.id] = r[SEX] > 0.0;
+    double t = exit_time(agent);
+    if (total > 0.0)
+      t = std::min(t, now + std::exponential_distribution<double>(total)(rng));
+    queue.push(agent.id, t);
+  }
+
+  void fire(Agent& agent)
+  {
+    if (now >= exit_time(agent)) {
+      remove(agent);
+      return;
+    }
+    agent.age = now - birth[agent.id];
+    double r[NUM_EVENTS], total = 0.0;
+    rates(agent, r);
+    for (unsigned e = 0; e < NUM_EVENTS; ++e)
+      total += r[e];
+    double x = std::uniform_real_distribution<double>(0.0, total)(rng);
+    unsigned event = 0;
+    while (event < NUM_EVENTS - 1 && (x -= r[event]) >= 0.0)
+      ++event;
+
+    switch (event) {
+    case BREAKUP: {
+      Agent& partner = population[agent.partners.back()];
+      population.dissolve_partnership(agent, partner.id);
+      schedule(partner);
+      break;
+    }
+    case SEEK_PARTNER:
+      seek_partner(agent);
+      break;
+    case SEX:
+      have_sex(agent);
+      break;
+    case INFECTION:
+      // Thinned from the clock at the bound to the actual prevalence
+      if (std::uniform_real_distribution<double>(0.0, r[INFECTION])(rng) <
+	  infection_rate(agent, partner_prevalence[agent.sex]))
+	infect(agent);
+      break;
+    case STAGE_ADVANCE:
+      ++agent.hiv;
+      population.log.write(LOG_STAGE, agent.id, agent.hiv);
+      break;
+    case START_ART:
+      agent.art = true;
+      population.log.write(LOG_ART, agent.id);
+      break;
+    case DEATH:
+      remove(agent);
+      return;
+    }
+    schedule(agent);
+  }
+
+  void infect(Agent& agent)
+  {
+    agent.hiv = 1;
+    counts.infected[agent.sex] += agent.weight;
+    population.new_infections[agent.sex] += agent.weight;
+    population.log.write(LOG_INFECTION, agent.id);
+  }
+
+  void remove(Agent& agent)
+  {
+    HandleVector partners = agent.partners;
+    agent.alive = false;
+    --counts.agents[agent.sex];
+    counts.alive[agent.sex] -= agent.weight;
+    if (agent.hiv > 0)
+      counts.infected[agent.sex] -= agent.weight;
+    population.remove(agent);
+    queue.remove(agent.id);
+    pool->forget(agent.id);
+    population.recycle(agent);
+    for (auto& partner: partners)
+      schedule(population[partner]);
+  }
+
+  void seek_partner(Agent& agent)
+  {
+    size_t partners = agent.partners.size();
+    pool->match(population, space, agent, now);
+    if (agent.partners.size() > partners)
+      schedule(population[agent.partners.back()]);
+  }
+
+  void have_sex(Agent& agent)
+  {
+    Agent& partner = population[agent.partners[agent.choose_partner()]];
+    bool condom = std::bernoulli_distribution(condom_use)(rng);
+    population.log.write(LOG_ACT, agent.id, partner.id, condom);
+    if ((agent.hiv > 0) == (partner.hiv > 0))
+      return;
+    Agent& source = agent.hiv > 0 ? agent : partner;
+    Agent& receiver = agent.hiv > 0 ? partner : agent;
+    if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) <
+	transmission_table(source.hiv, receiver.sex, condom, source.art) *
+	exposure(source, receiver)) {
+      receiver.hiv = 1;
+      counts.infected[receiver.sex] += receiver.weight;
+      population.new_infections[receiver.sex] += receiver.weight;
+      population.log.write(LOG_INFECTION, receiver.id, source.id);
+      population.transmissions.record(source.id, receiver.id, date(now),
+				      source.hiv);
+      // The receiver's other partners may now have sex that can transmit
+      for (auto& handle: receiver.partners)
+	if (handle != agent.id)
+	  schedule(population[handle]);
+      if (&receiver != &agent)
+	schedule(receiver);
+    }
+  }
+
+  // Updates partner prevalence from the counts, and in the prevalence
+  // based model moves the bound for either sex, and reschedules its
+  // susceptible agents, if prevalence has passed it or fallen well below it
+  void update_prevalence()
+  {
+    for (unsigned s = 0; s < 2; ++s) {
+      double prevalence = (double) counts.infected[1 - s] / counts.alive[1 - s];
+      partner_prevalence[s] = prevalence;
+      if (per_act_transmission)
+	continue;
+      double bound = std::min(1.0, 2.0 * prevalence);
+      if (bound < MIN_PREVALENCE_BOUND)
+	bound = MIN_PREVALENCE_BOUND;
+      if (queue.empty())
+	prevalence_bound[s] = bound;
+      else if (prevalence > prevalence_bound[s] ||
+	       bound < prevalence_bound[s] / 2.0) {
+	prevalence_bound[s] = bound;
+	for (auto& agent: population.agents[s])
+	  if (agent.alive && agent.hiv == 0)
+	    schedule(agent);
+      }
+    }
+  }
+
+  // Entries happen at the start of each step, so that the step's report,
+  // like the event log replayed, covers its events up to the next step
+  void begin_step()
+  {
+    unsigned num_entries = std::poisson_distribution<unsigned>
+      (entry_rate * (counts.agents[MALE] + counts.agents[FEMALE]) *
+       time_step)(rng);
+    for (unsigned i = 0; i < num_entries; ++i) {
+      Sex sex = random_sex();
+      AgentHandle handle = population.add(sex);
+      Agent& agent = population[handle];
+      agent.entry(handle, sex, parameters);
+      ++counts.agents[sex];
+      counts.alive[sex] += agent.weight;
+      enter(agent);
+    }
+    if (population.num_free() > compaction_threshold * population.size())
+      population.compact();
+    update_prevalence();
+    if (per_act_transmission && population.log.writer)
+      log_concordant_acts();
+  }
+
+  // Logs the acts over the coming step of agents who have no sex clock,
+  // at most one each, as in the time step engine
+  void log_concordant_acts()
+  {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::bernoulli_distribution condom_dist(condom_use);
+    for (auto& agents: population.agents)
+      for (auto& agent: agents) {
+	if (!agent.alive || agent.partners.size() == 0 ||
+	    sex_clock[agent.id] ||
+	    uniform(log_rng) >= agent.sexual_drive_attribute)
+	  continue;
+	population.log.write(LOG_ACT, agent.id,
+			     agent.partners[agent.choose_partner(log_rng)],
+			     condom_dist(log_rng));
+      }
+  }
+};
+
+/*
+  Tau leaping hybrid for large populations, in which only agents with
+  partners are simulated individually. Single agents are aggregated into
+  strata by sex, HIV stage, ART, one year age band and their partner
+  forming, relationship stickiness and concurrency attributes (each in
+  HYBRID_ATTRIBUTE_BINS equally likely bins), and on each
+  TIME_STEP the numbers in each stratum who die, seek a partner, move up an
+  age band (or leave the model from the last one), advance stage, start ART
+  or, in the prevalence based model, are infected, are drawn as binomial
+  counts. Ageing is therefore at a constant rate rather than at a fixed
+  age.
+
+  Singles who seek a partner are materialised as individuals, with an age
+  drawn uniformly from their band, binned attributes drawn from their bins
+  and their other attributes drawn afresh, and are matched with the
+  individuals who seek partners. Individuals who are single at the end of
+  a step are folded back into the strata and their handles recycled.
+  Every event runs every TIME_STEP: the event class time steps are ignored,
+  as are agents' weights other than AGENT_WEIGHT. Nothing is written to
+  the event log. The strata are kept between calls to run(), and only
+  handed back as individuals by finish().
+
+  Singles are selected towards high breakup and low concurrency, which
+  drawing those attributes afresh would undo, inflating partnerships.
+  Binning them keeps the selection, up to the spread within bins, which
+  shrinks as HYBRID_ATTRIBUTE_BINS grows: with 8 bins, partnerships at the
+  end of a year of 100,000 agents are within about 1% of the time step
+  engine's, against 8% with only the partner forming attribute binned.
+  Sexual drive and FIFS preference don't affect who is single. Infection
+  force does in the prevalence based model, where materialised agents are
+  therefore slightly too likely to be infected.
+*/
+class HybridSimulation {
+public:
+  HybridSimulation(Population& p, const ParameterMap& parameters) :
+    population(p), parameters(parameters), step(0), first_step(0),
+    burning_in(false)
+  {
+    time_step = parameters.at("TIME_STEP");
+    start_date = parameters.at("START_DATE");
+    entry_age = parameters.at("ENTRY_AGE");
+    exit_age = parameters.at("EXIT_AGE");
+    entry_rate = parameters.at("ENTRY_RATE");
+    compaction_threshold = parameters.at("COMPACTION_THRESHOLD");
+    matcher.init(parameters);
+    reorder_steps =
+      std::max(1.0, round(parameters.at("REORDER_INTERVAL") / time_step));
+    per_act_transmission = parameters.at("PER_ACT_TRANSMISSION") != 0.0;
+    write_report = parameters.at("REPORT") != 0.0;
+    network_steps = network_interval(parameters);
+    network_threads = parameters.at("NETWORK_THREADS");
+    component_steps = component_interval(parameters);
+    condom_dist = std::bernoulli_distribution(parameters.at("CONDOM_USE"));
+    prob_leave_acute_infection = parameters.at("LEAVE_ACUTE_INFECTION");
+    prob_start_art = 1.0 - exp(-parameters.at("ART_INITIATION_RATE") *
+			       time_step);
+    mortality_rates(parameters, prob_death);
+    for (unsigned i = 0; i < NUM_STAGES; ++i)
+      prob_death[i] = 1.0 - exp(-prob_death[i] * time_step);
+    mean_force[MALE] = parameters.at("MEAN_RISK_HET_MALE_SEX");
+    mean_force[FEMALE] = parameters.at("MEAN_RISK_HET_FEMALE_SEX");
+    weight = parameters.at("AGENT_WEIGHT");
+
+    num_bands = std::max(1.0, round(exit_age - entry_age));
+    band_width = (exit_age - entry_age) / num_bands;
+    prob_next_band = std::min(1.0, time_step / band_width);
+    num_bins = std::max(1.0, parameters.at("HYBRID_ATTRIBUTE_BINS"));
+    init_bins();
+    strata.assign(2 * NUM_STAGES * 2 * num_bands *
+		  pow(num_bins, NUM_BINNED), 0);
+    next.resize(strata.size());
+
+    space.init(parameters);
+    transmission_table.init(parameters);
+  }
+
+  // Nothing is reported while burning in, and dates restart from
+  // START_DATE once burn-in ends
+  void set_burning_in(const bool b)
+  {
+    burning_in = b;
+    if (!b)
+      first_step = step;
+  }
+
+  RunStatistics statistics() const
+  {
+    unsigned singles = 0, infected_singles = 0;
+    for (auto i: occupied) {
+      singles += strata[i] * weight;
+      if (stratum(i).hiv > 0)
+	infected_singles += strata[i] * weight;
+    }
+    return run_statistics(population, singles, infected_singles);
+  }
+
+  // Runs for the given number of TIME_STEPs, carrying on from the last
+  // run. Singles, such as those handed back by finish(), are first folded
+  // into the strata.
+  void run(const unsigned steps)
+  {
+    // Materialising and folding agents isn't logged
+    sim::event_log_writer* writer = population.log.writer;
+    population.log.writer = NULL;
+    for (auto& agents: population.agents)
+      for (auto& agent: agents)
+	if (agent.alive && agent.partners.size() == 0)
+	  fold(agent);
+    for (unsigned last = step + steps; step < last; ++step) {
+      if (step % reorder_steps == 0)
+	population.reorder(space);
+      double date = start_date + time_step * (step - first_step);
+
+      Prevalence p;
+      unsigned hiv[NUM_STAGES];
+      totals(p, hiv);
+
+      // Individuals who may be single by the end of the step, to be folded,
+      // and those who die, whose handles are recycled
+      acts.clear();
+      singles.clear();
+      dead.clear();
+      for (unsigned s = 0; s < 2; ++s) {
+	seekers[s].clear();
+	for (auto& agent: population.agents[s]) {
+	  if (!agent.alive)
+	    continue;
+	  if (agent.breakup_event(1)) {
+	    singles.push_back(agent.partners.back());
+	    population.dissolve_partnership(agent, agent.partners.back());
+	  }
+	  if (agent.seek_partner_event(1))
+	    seekers[s].push_back(agent.id);
+	  if (per_act_transmission) {
+	    if (agent.sex_event(1))
+	      acts.push_back({agent.id, agent.partners[agent.choose_partner()],
+			      condom_dist(rng)});
+	  } else if (agent.simple_infection_event(p.prevalence[1 - s], 1)) {
+	    population.new_infections[s] += agent.weight;
+	  }
+	  agent.stage_advance_event(prob_leave_acute_infection);
+	  agent.art_event(prob_start_art);
+	  agent.mortality_event(prob_death);
+	  if (agent.alive)
+	    agent.age_event(time_step, exit_age);
+	  if (!agent.alive) {
+	    singles.insert(singles.end(), agent.partners.begin(),
+			   agent.partners.end());
+	    population.remove(agent);
+	    dead.push_back(agent.id);
+	  } else if (agent.partners.size() == 0) {
+	    singles.push_back(agent.id);
+	  }
+	}
+      }
+      transmission_events(population, transmission_table, acts, date);
+
+      std::vector<Stratum> new_seekers;
+      step_strata(p, new_seekers);
+
+      // The handles of the dead can't be recycled until nothing refers to
+      // them any more
+      if (dead.size() > 0)
+	for (auto& sex_seekers: seekers)
+	  sex_seekers.erase(std::remove_if(sex_seekers.begin(),
+					   sex_seekers.end(),
+					   [this](const AgentHandle h) {
+					     return !population[h].alive;
+					   }),
+			    sex_seekers.end());
+      for (auto handle: dead)
+	population.recycle(population[handle]);
+      for (auto& stratum: new_seekers) {
+	AgentHandle handle = materialise(stratum);
+	seekers[stratum.sex].push_back(handle);
+	singles.push_back(handle);
+      }
+      matcher.match(population, space, seekers);
+
+      unsigned num_entries = std::poisson_distribution<unsigned>
+	(entry_rate * (p.agents[MALE] + p.agents[FEMALE]) * time_step)(rng);
+      std::uniform_int_distribution<unsigned> bin_dist(0, num_bins - 1);
+      for (unsigned j = 0; j < num_entries; ++j) {
+	Stratum s = {random_sex(), 0, false, 0, {}};
+	for (auto& bin: s.bins)
+	  bin = bin_dist(rng);
+	add(strata, occupied, index(s), 1);
+      }
+
+      // A handle may be listed more than once, or have been recycled and
+      // given to a materialised agent, who is folded all the same if single
+      for (auto handle: singles)
+	if (population.is_alive(handle) &&
+	    population[handle].partners.size() == 0)
+	  fold(population[handle]);
+      if (population.num_free() > compaction_threshold * population.size())
+	population.compact();
+
+      if (write_report && !burning_in) {
+	totals(p, hiv);
+	report_line(date, population.size() + aggregated(), p, hiv);
+      }
+      if (network_steps && !burning_in &&
+	  (step - first_step) % network_steps == 0)
+	network_report(date, population, network_threads, aggregated());
+      if (component_steps)
+	component_report(date, population, step, component_steps,
+			 write_report && !burning_in);
+    }
+    population.log.writer = writer;
+  }
+
+  // Hands back a fully individual population
+  void finish()
+  {
+    sim::event_log_writer* writer = population.log.writer;
+    population.log.writer = NULL;
+    for (auto i: occupied) {
+      for (unsigned j = 0; j < strata[i]; ++j)
+	materialise(stratum(i));
+      strata[i] = 0;
+    }
+    occupied.clear();
+    population.log.writer = writer;
+  }
+
+private:
+  static const unsigned NUM_STAGES = 6;
+  // Attributes sampled per bin, from which materialised agents draw theirs
+  static const unsigned SAMPLES_PER_BIN = 1000;
+
+  // Attributes singles are binned by
+  enum Binned {
+    FORMING,
+    STICKINESS,
+    CONCURRENCY,
+    NUM_BINNED
+  };
+
+  struct Stratum {
+    Sex sex;
+    unsigned hiv;
+    bool art;
+    unsigned band;
+    unsigned bins[NUM_BINNED];
+  };
+
+  Population& population;
+  const ParameterMap& parameters;
+  MatchingSpace space;
+  TransmissionTable transmission_table;
+  double time_step, start_date, entry_age, exit_age, entry_rate;
+  double compaction_threshold;
+  Matcher matcher;
+  HandleVector seekers[2], singles, dead;
+  std::vector<SexAct> acts;
+  std::bernoulli_distribution condom_dist;
+  unsigned reorder_steps;
+  unsigned network_steps, network_threads, component_steps;
+  bool per_act_transmission, write_report;
+  double prob_leave_acute_infection, prob_start_art;
+  double prob_death[NUM_STAGES], mean_force[2];
+  unsigned num_bands, num_bins;
+  double band_width, prob_next_band;
+  // Every aggregated agent represents AGENT_WEIGHT people
+  unsigned weight;
+  double Agent::*binned[NUM_BINNED] = {
+    &Agent::partner_forming_attribute,
+    &Agent::relationship_stickiness_attribute,
+    &Agent::concurrency_attribute
+  };
+  // For each binned attribute, a sorted sample, SAMPLES_PER_BIN per bin,
+  // the lower bounds of bins 1 and up, and the mean in each bin
+  std::vector<double> samples[NUM_BINNED], bin_edges[NUM_BINNED];
+  std::vector<double> bin_means[NUM_BINNED];
+  // Number of single agents in each stratum, and next step's numbers,
+  // which are kept at 0 between steps, with the indices of the strata
+  // that aren't empty
+  std::vector<unsigned> strata, next;
+  std::vector<size_t> occupied, next_occupied;
+  // TIME_STEPs run so far, and the one on which the measured phase began
+  unsigned step, first_step;
+  bool burning_in;
+
+  void init_bins()
+  {
+    Agent agent;
+    agent.sex = MALE;
+    for (auto& sample: samples)
+      sample.resize(num_bins * SAMPLES_PER_BIN);
+    for (size_t i = 0; i < num_bins * SAMPLES_PER_BIN; ++i) {
+      agent.init_attributes(parameters);
+      for (unsigned a = 0; a < NUM_BINNED; ++a)
+	samples[a][i] = agent.*binned[a];
+    }
+    for (unsigned a = 0; a < NUM_BINNED; ++a) {
+      std::sort(samples[a].begin(), samples[a].end());
+      for (unsigned b = 0; b < num_bins; ++b) {
+	auto begin = samples[a].begin() + b * SAMPLES_PER_BIN;
+	if (b > 0)
+	  bin_edges[a].push_back(*begin);
+	bin_means[a].push_back(std::accumulate(begin, begin + SAMPLES_PER_BIN,
+					       0.0) / SAMPLES_PER_BIN);
+      }
+    }
+  }
+
+  size_t index(const Stratum& s) const
+  {
+    size_t i = ((s.sex * NUM_STAGES + s.hiv) * 2 + s.art) * num_bands +
+      s.band;
+    for (unsigned a = 0; a < NUM_BINNED; ++a)
+      i = i * num_bins + s.bins[a];
+    return i;
+  }
+
+  Stratum stratum(size_t i) const
+  {
+    Stratum s;
+    for (unsigned a = NUM_BINNED; a-- > 0; ) {
+      s.bins[a] = i % num_bins;
+      i /= num_bins;
+    }
+    s.band = i % num_bands;
+    i /= num_bands;
+    s.art = i % 2;
+    i /= 2;
+    s.hiv = i % NUM_STAGES;
+    s.sex = (Sex) (i / NUM_STAGES);
+    return s;
+  }
+
+  Stratum stratum(const Agent& agent) const
+  {
+    unsigned band = std::min(num_bands - 1.0,
+			     floor((agent.age - entry_age) / band_width));
+    Stratum s = {agent.sex, agent.hiv, agent.art, band, {}};
+    for (unsigned a = 0; a < NUM_BINNED; ++a)
+      s.bins[a] = std::upper_bound(bin_edges[a].begin(), bin_edges[a].end(),
+				   agent.*binned[a]) - bin_edges[a].begin();
+    return s;
+  }
+
+  static unsigned draw(const unsigned n, const double prob)
+  {
+    if (n == 0 || prob <= 0.0)
+      return 0;
+    return std::binomial_distribution<unsigned>(n, std::min(prob, 1.0))(rng);
+  }
+
+  // Adds n agents to stratum i of counts, whose non-empty strata are listed
+  // in nonempty
+  static void add(std::vector<unsigned>& counts,
+		  std::vector<size_t>& nonempty, const size_t i,
+		  const unsigned n)
+  {
+    if (n == 0)
+      return;
+    if (counts[i] == 0)
+      nonempty.push_back(i);
+    counts[i] += n;
+  }
+
+  size_t aggregated() const
+  {
+    size_t total = 0;
+    for (auto i: occupied)
+      total += strata[i];
+    return total;
+  }
+
+  void fold(Agent& agent)
+  {
+    add(strata, occupied, index(stratum(agent)), 1);
+    population.recycle(agent);
+  }
+
+  AgentHandle materialise(const Stratum& s)
+  {
+    AgentHandle handle = population.add(s.sex);
+    Agent& agent = population[handle];
+    agent.entry(handle, s.sex, parameters);
+    agent.age = entry_age + band_width *
+      (s.band + std::uniform_real_distribution<double>(0.0, 1.0)(rng));
+    agent.hiv = s.hiv;
+    agent.art = s.art;
+    std::uniform_int_distribution<unsigned> sample(0, SAMPLES_PER_BIN - 1);
+    for (unsigned a = 0; a < NUM_BINNED; ++a)
+      agent.*binned[a] = samples[a][s.bins[a] * SAMPLES_PER_BIN + sample(rng)];
+    return handle;
+  }
+
+  // Each single agent has at most one transition per step, drawn in turn
+  // from those who remain in the stratum.
+  void step_strata(const Prevalence& p, std::vector<Stratum>& seekers)
+  {
+    next_occupied.clear();
+    for (auto i: occupied) {
+      unsigned n = strata[i];
+      strata[i] = 0;
+      Stratum s = stratum(i);
+      n -= draw(n, prob_death[s.hiv]);
+
+      double prob_seek = bin_means[FORMING][s.bins[FORMING]];
+      unsigned m = draw(n, prob_seek);
+      n -= m;
+      seekers.insert(seekers.end(), m, s);
+
+      m = draw(n, prob_next_band);
+      n -= m;
+      if (s.band + 1 < num_bands) {
+	Stratum older = s;
+	++older.band;
+	add(next, next_occupied, index(older), m);
+      }
+
+      Stratum moved = s;
+      if (s.hiv == 0 && !per_act_transmission) {
+	m = draw(n, mean_force[s.sex] * prob_seek * p.prevalence[1 - s.sex]);
+	moved.hiv = 1;
+	population.new_infections[s.sex] += m * weight;
+      } else if (s.hiv == 1) {
+	m = draw(n, prob_leave_acute_infection);
+	moved.hiv = 2;
+      } else if (s.hiv > 1 && !s.art) {
+	m = draw(n, prob_start_art);
+	moved.art = true;
+      } else {
+	m = 0;
+      }
+      n -= m;
+      add(next, next_occupied, index(moved), m);
+      add(next, next_occupied, i, n);
+    }
+    strata.swap(next);
+    occupied.swap(next_occupied);
+  }
+
+  // Prevalence and numbers by HIV stage over individuals and strata
+  void totals(Prevalence& p, unsigned hiv[NUM_STAGES]) const
+  {
+    p = Prevalence();
+    std::fill(hiv, hiv + NUM_STAGES, 0);
+    for (unsigned s = 0; s < 2; ++s)
+      for (auto& agent: population.agents[s])
+	if (agent.alive) {
+	  ++p.agents[s];
+	  p.alive[s] += agent.weight;
+	  if (agent.hiv > 0)
+	    p.infected[s] += agent.weight;
+	  hiv[agent.hiv] += agent.weight;
+	}
+    for (auto i: occupied) {
+      Stratum s = stratum(i);
+      p.agents[s.sex] += strata[i];
+      p.alive[s.sex] += strata[i] * weight;
+      if (s.hiv > 0)
+	p.infected[s.sex] += strata[i] * weight;
+      hiv[s.hiv] += strata[i] * weight;
+    }
+    for (unsigned s = 0; s < 2; ++s)
+      p.prevalence[s] = (double) p.infected[s] / p.alive[s];
+  }
+};
+
+enum Engine {
+  TIME_STEP_ENGINE = 0,
+  NEXT_EVENT_ENGINE = 1,
+  HYBRID_ENGINE = 2
+};
+
+/*
+  Runs the engine, unreported, for up to MAX_BURN_IN years before the
+  measured phase, sampling prevalence, partnerships and concurrency every
+  BURN_IN_SAMPLE_INTERVAL (rounded to a whole number of TIME_STEPs). The
+  population is taken to have reached steady state, and burn-in ends, once
+  each statistic's mean over the last half of a BURN_IN_WINDOW differs from
+  its mean over the first half by less than BURN_IN_TOLERANCE, relative to
+  the latter. Burn-in is one continuous run of the engine, which the
+  measured phase carries on. Transmissions during burn-in are dropped from
+  the transmission tree. Returns the years burnt in.
+*/
+template <typename Simulation>
+static double burn_in(Simulation& engine, Population& population,
+		      const ParameterMap& parameters)
+{
+  double time_step = parameters.at("TIME_STEP");
+  double max_years = parameters.at("MAX_BURN_IN");
+  unsigned interval_steps =
+    std::max(1.0, round(parameters.at("BURN_IN_SAMPLE_INTERVAL") /
+			time_step));
+  double tolerance = parameters.at("BURN_IN_TOLERANCE");
+  size_t half_window =
+    std::max(1.0, round(parameters.at("BURN_IN_WINDOW") / time_step /
+			interval_steps / 2.0));
+  // Dates restart from START_DATE once burn-in ends, so it isn't logged
+  sim::event_log_writer* writer = population.log.writer;
+  population.log.writer = NULL;
+  engine.set_burning_in(true);
+
+  double RunStatistics::*fields[] = {
+    &RunStatistics::prevalence, &RunStatistics::partnerships,
+    &RunStatistics::concurrency
+  };
+  std::vector<sim::window_drift<double> > windows
+    (3, sim::window_drift<double>(half_window));
+  unsigned steps = 0;
+  while (steps * time_step < max_years) {
+    engine.run(interval_steps);
+    steps += interval_steps;
+    RunStatistics statistics = engine.statistics();
+    bool steady = true;
+    for (unsigned i = 0; i < 3; ++i) {
+      windows[i].push(statistics.*fields[i]);
+      steady = steady && windows[i].full() && windows[i].drift() < tolerance;
+    }
+    if (steady)
+      break;
+  }
+  engine.set_burning_in(false);
+  population.log.writer = writer;
+  population.transmissions.clear();
+  return steps * time_step;
+}
+
+// Burns in if MAX_BURN_IN is set, then runs the measured phase, which the
+// event log, if any, covers. Unless outputs is NULL, the measured phase is
+// preceded by the begin summary, kept in outputs, and the report header
+// and first line.
+template <typename Simulation>
+static void run_engine(Simulation& engine, Population& population,
+		       const ParameterMap& parameters, ParameterMap* outputs)
+{
+  if (parameters.at("MAX_BURN_IN") > 0.0) {
+    double years = burn_in(engine, population, parameters);
+    if (parameters.at("REPORT") != 0.0)
+      std::cout << "summary,0,burn-in,Years," << years << std::endl;
+  }
+  if (outputs) {
+    engine.finish();
+    summary(0, "begin", population, *outputs);
+    std::cout << "year, agents, alive, infected, prevalence, males_alive, "
+      "males_infected, male_prevalence, females_alive, females_infected, "
+      "female_prevalence, hiv_neg, hiv_p, cdc1, cdc2, cdc3, cdc4"
+	      << std::endl;
+    report(parameters.at("START_DATE"), population);
+  }
+  // The event log starts from the population as the measured phase finds it
+  population.log.time = parameters.at("START_DATE");
+  population.log.snapshot(population.agents);
+  engine.run(parameters.at("NUM_YEARS") / parameters.at("TIME_STEP"));
+  engine.finish();
+}
+
+void simulate(Population& population, const ParameterMap& parameters,
+	      ParameterMap* outputs)
+{
+  if (parameters.at("ENGINE") == NEXT_EVENT_ENGINE) {
+    NextEventSimulation engine(population, parameters);
+    run_engine(engine, population, parameters, outputs);
+  } else if (parameters.at("ENGINE") == HYBRID_ENGINE) {
+    HybridSimulation engine(population, parameters);
+    run_engine(engine, population, parameters, outputs);
+  } else {
+    TimeStepSimulation engine(population, parameters);
+    run_engine(engine, population, parameters, outputs);
+  }
+}
+
+/*
+  Runs BENCHMARK_REPLICATES simulations with the given parameters, each
+  seeded differently, and writes the mean and standard deviation over the
+  replicates of the run time and end of run statistics as CSV lines
+  prefixed by "benchmark", the benchmark and the label.
+*/
+static void benchmark_runs(const char *benchmark, const char *label,
+			   ParameterMap parameters)
+{
+  unsigned replicates = parameters.at("BENCHMARK_REPLICATES");
+  unsigned seed = parameters.at("SEED");
+  parameters["REPORT"] = 0.0;
+  std::vector<RunStatistics> runs;
+  for (unsigned r = 0; r < replicates; ++r) {
+    rng.seed(seed + r);
+    Population population;
+    initialize_agents(population, parameters.at("NUM_AGENTS"), parameters);
+    auto start = std::chrono::steady_clock::now();
+    simulate(population, parameters, NULL);
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    runs.push_back(run_statistics(population));
+    runs.back().seconds = elapsed.count();
+  }
+
+  const char *names[] = {"seconds", "prevalence", "partnerships",
+			 "concurrency"};
+  double RunStatistics::*fields[] = {
+    &RunStatistics::seconds, &RunStatistics::prevalence,
+    &RunStatistics::partnerships, &RunStatistics::concurrency
+  };
+  for (unsigned i = 0; i < 4; ++i) {
+    std::vector<double> values;
+    for (auto& run: runs)
+      values.push_back(run.*fields[i]);
+    double mean = sim::mean(values), variance = 0.0;
+    for (auto& v: values)
+      variance += (v - mean) * (v - mean);
+    variance /= std::max<size_t>(values.size() - 1, 1);
+    std::cout << "benchmark," << benchmark << "," << label << ","
+	      << names[i] << "," << mean << "," << sqrt(variance)
+	      << std::endl;
+  }
+}
+
+// Compares multi-rate time stepping (daily sex, weekly stage advance,
+// monthly partnership and demography events) with uniform TIME_STEPs.
+static void benchmark_time_steps(ParameterMap parameters)
+{
+  double time_step = parameters.at("TIME_STEP");
+  parameters["ENGINE"] = TIME_STEP_ENGINE;
+  parameters["SEX_TIME_STEP"] = time_step;
+  parameters["STAGE_TIME_STEP"] = time_step;
+  parameters["PARTNERSHIP_TIME_STEP"] = time_step;
+  parameters["DEMOGRAPHY_TIME_STEP"] = time_step;
+  benchmark_runs("time_steps", "uniform", parameters);
+  parameters["SEX_TIME_STEP"] = DAY;
+  parameters["STAGE_TIME_STEP"] = WEEK;
+  parameters["PARTNERSHIP_TIME_STEP"] = MONTH;
+  parameters["DEMOGRAPHY_TIME_STEP"] = MONTH;
+  benchmark_runs("time_steps", "multirate", parameters);
+}
+
+/*
+  Compares runs in which each agent represents one person with runs of the
+  same population simulated with fewer agents each representing several.
+  The bias is the difference of each weight's means from those at weight 1,
+  and the standard deviations show the extra variance.
+*/
+static void benchmark_weights(ParameterMap parameters)
+{
+  double people = parameters.at("NUM_AGENTS") * parameters.at("AGENT_WEIGHT");
+  const unsigned weights[] = {1, 2, 5, 10, 20};
+  for (auto weight: weights) {
+    parameters["AGENT_WEIGHT"] = weight;
+    parameters["NUM_AGENTS"] = round(people / weight);
+    std::string label = "weight=" + std::to_string(weight);
+    benchmark_runs("weights", label.c_str(), parameters);
+  }
+}
+
+/*
+  Compares the matching algorithms, with the time step engine. Besides
+  whole runs, each matches a single round in which every agent of the
+  initial population is a seeker, as does exact_nearest_match(), and the
+  time taken, the number of partnerships formed and their mean distance
+  in matching space are written as "benchmark,matching-round" lines. The
+  round is timed again on a copy of the population that has been through
+  Population::reorder(), to measure what storing agents in matching key
+  order saves in cache misses.
+*/
+static void benchmark_matching(ParameterMap parameters)
+{
+  const char *labels[] = {"nearest-key", "stable", "lsh", "handshake",
+			 "age-mixing"};
+  const unsigned num_algorithms = sizeof labels / sizeof labels[0];
+  parameters["ENGINE"] = TIME_STEP_ENGINE;
+  for (unsigned algorithm = 0; algorithm < num_algorithms; ++algorithm) {
+    parameters["MATCHING"] = algorithm;
+    benchmark_runs("matching", labels[algorithm], parameters);
+  }
+
+  rng.seed(parameters.at("SEED"));
+  Population population;
+  initialize_agents(population, parameters.at("NUM_AGENTS"), parameters);
+  MatchingSpace space;
+  space.init(parameters);
+  Matcher matcher;
+  matcher.init(parameters);
+  HandleVector seekers[2];
+  for (unsigned s = 0; s < 2; ++s)
+    for (auto& agent: population.agents[s])
+      seekers[s].push_back(agent.id);
+  Population reordered = population;
+  reordered.reorder(space);
+  for (int algorithm = -1; algorithm < (int) num_algorithms; ++algorithm) {
+    Population matched;
+    std::chrono::duration<double> elapsed[2];
+    for (unsigned r = 0; r < 2; ++r) {
+      matched = r == 0 ? population : reordered;
+      HandleVector round[2] = {seekers[MALE], seekers[FEMALE]};
+      auto start = std::chrono::steady_clock::now();
+      if (algorithm < 0) {
+	exact_nearest_match(matched, space, round);
+      } else {
+	matcher.algorithm = algorithm;
+	matcher.match(matched, space, round);
+      }
+      elapsed[r] = std::chrono::steady_clock::now() - start;
+    }
+    unsigned pairs = 0;
+    double distance = 0.0;
+    for (auto& male: matched.agents[MALE])
+      for (auto& partner: male.partners) {
+	++pairs;
+	distance += space.distance(male, matched[partner]);
+      }
+    const char *label = algorithm < 0 ? "exact" : labels[algorithm];
+    std::cout << "benchmark,matching-round," << label << ",seconds,"
+	      << elapsed[0].count() << std::endl
+	      << "benchmark,matching-round," << label << ",reordered-seconds,"
+	      << elapsed[1].count() << std::endl
+	      << "benchmark,matching-round," << label << ",partnerships,"
+	      << pairs << std::endl
+	      << "benchmark,matching-round," << label << ",distance,"
+	      << (pairs > 0 ? distance / pairs : 0.0) << std::endl;
+  }
+}
+
+/*
+  Times draws from discrete distributions over 4 to 2048 outcomes, with
+  skewed weights, by std::discrete_distribution and by sim::alias_table
+  singly and in batches, and writes the nanoseconds per draw as
+  "benchmark,sampling" lines.
+*/
+static void benchmark_sampling(const ParameterMap& parameters)
+{
+  const size_t draws = 10000000, batch = 4096;
+  rng.seed(parameters.at("SEED"));
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  for (unsigned n = 4; n <= 4096; n *= 8) {
+    std::vector<double> weights(n);
+    for (auto& w: weights)
+      w = pow(uniform(rng), 3.0);
+    std::discrete_distribution<unsigned> discrete(weights.begin(),
+						  weights.end());
+    sim::alias_table<> alias(weights);
+    std::vector<unsigned> values(batch);
+    // Summed so that the draws can't be optimised away
+    unsigned long total = 0;
+    for (unsigned method = 0; method < 3; ++method) {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < draws; i += batch) {
+	if (method == 0)
+	  for (auto& v: values)
+	    v = discrete(rng);
+	else if (method == 1)
+	  for (auto& v: values)
+	    v = alias(rng);
+	else
+	  alias.generate(rng, values.begin(), batch);
+	total += std::accumulate(values.begin(), values.end(), 0UL);
+      }
+      std::chrono::duration<double> elapsed =
+	std::chrono::steady_clock::now() - start;
+      const char *names[] = {"discrete", "alias", "alias-batched"};
+      std::cout << "benchmark,sampling," << names[method] << "-" << n
+		<< ",ns-per-draw," << elapsed.count() * 1e9 / draws
+		<< std::endl;
+    }
+    if (total == 0)
+      std::cout << std::endl;
+  }
+}
+
+/*
+  Recomputes outputs from an event log written by the log command, without
+  simulating again. The population is rebuilt from the snapshot at the
+  start of the log and updated event by event, and every REPLAY_INTERVAL
+  from START_DATE a line is written with the state after all events before
+  the next interval: either a report() line (in which agents is the number
+  of handles logged), or, with REPLAY_TABLE set to 1, a table of those
+  alive, infected and partnered by sex and one year age band. Parameters
+  the log doesn't record, such as ENTRY_AGE and AGENT_WEIGHT, have to be
+  given as they were when it was written.
+*/
+class Replay {
+public:
+  Replay(const ParameterMap& parameters)
+  {
+    start_date = parameters.at("START_DATE");
+    interval = parameters.at("REPLAY_INTERVAL");
+    entry_age = parameters.at("ENTRY_AGE");
+    exit_age = parameters.at("EXIT_AGE");
+    weight = parameters.at("AGENT_WEIGHT");
+    table = parameters.at("REPLAY_TABLE") != 0.0;
+  }
+
+  bool run(const char* path)
+  {
+    sim::event_log_reader reader(path);
+    if (!reader.good()) {
+      std::cerr << "Can't read event log: " << path << std::endl;
+      return false;
+    }
+    tick = reader.tick();
+    // Allow for times having been rounded to ticks
+    double tolerance = tick / 2.0;
+    if (table)
+      std::cout << "year, sex, age, alive, infected, partnered" << std::endl;
+    else
+      std::cout << "year, agents, alive, infected, prevalence, males_alive, "
+	"males_infected, male_prevalence, females_alive, females_infected, "
+	"female_prevalence, hiv_neg, hiv_p, cdc1, cdc2, cdc3, cdc4"
+		<< std::endl;
+
+    double date = start_date;
+    bool any = false;
+    for (auto& event: reader) {
+      while (event.time >= date + interval - tolerance) {
+	if (any)
+	  output(date);
+	date += interval;
+      }
+      if (!apply(event)) {
+	std::cerr << "Inconsistent event log: " << path << " at "
+		  << event.time << std::endl;
+	return false;
+      }
+      any = true;
+    }
+    if (any)
+      output(date);
+    return true;
+  }
+
+private:
+  struct State {
+    Sex sex;
+    unsigned hiv;
+    bool art;
+    bool alive;
+    unsigned weight;
+    // Date at which the agent was, or would have been, aged 0
+    double birth;
+    HandleVector partners;
+  };
 
-  // Seed our Mersenne Twister to some arbitrarily chosen number
-  rng.seed(23);
-  AgentVector agents(10000);
-  initialize_agents(agents, parameters);
-  summary(0, "begin", agents, outputs);
-  std::cout << "year, agents, alive, infected, prevalence, males_alive, "
-    "males_infected, male_prevalence, females_alive, females_infected, "
-    "female_prevalence, hiv_neg, hiv_p, cdc1, cdc2, cdc3, cdc4"
+  double start_date, interval, entry_age, exit_age, tick;
+  unsigned weight;
+  bool table;
+  std::vector<State> agents;
+
+  State& agent(const AgentHandle handle)
+  {
+    if (handle >= agents.size())
+      agents.resize(handle + 1);
+    return agents[handle];
+  }
+
+  // Removes partner from partners, returning false if it isn't there
+  static bool unlink(HandleVector& partners, const AgentHandle partner)
+  {
+    auto it = std::find(partners.begin(), partners.end(), partner);
+    if (it == partners.end())
+      return false;
+    partners.erase(it);
+    return true;
+  }
+
+  // Updates the state with an event, returning false if the event doesn't
+  // fit it, as for a partnership that doesn't exist
+  bool apply(const sim::logged_event& event)
+  {
+    if (event.type == LOG_FORMATION || event.type == LOG_DISSOLUTION)
+      agent(event.values[1]);
+    State& a = agent(event.values[0]);
+    switch (event.type) {
+    case LOG_SNAPSHOT:
+      a.sex = (Sex) (event.values[1] & 1);
+      a.hiv = event.values[1] >> 1 & 7;
+      a.art = event.values[1] >> 4 & 1;
+      a.weight = event.values[1] >> 5;
+      a.alive = true;
+      a.birth = event.time - event.values[2] * tick;
+      a.partners.clear();
+      break;
+    case LOG_ENTRY:
+      a = State();
+      a.sex = (Sex) event.values[1];
+      a.alive = true;
+      a.weight = weight;
+      a.birth = event.time - entry_age;
+      break;
+    case LOG_REMOVAL:
+      if (!a.alive)
+	return false;
+      for (auto& handle: a.partners)
+	if (!unlink(agents[handle].partners, event.values[0]))
+	  return false;
+      a.partners.clear();
+      a.alive = false;
+      break;
+    case LOG_FORMATION: {
+      State& b = agents[event.values[1]];
+      if (!a.alive || !b.alive)
+	return false;
+      a.partners.push_back(event.values[1]);
+      b.partners.push_back(event.values[0]);
+      break;
+    }
+    case LOG_DISSOLUTION:
+      if (!unlink(agents[event.values[1]].partners, event.values[0]) ||
+	  !unlink(a.partners, event.values[1]))
+	return false;
+      break;
+    case LOG_INFECTION:
+      a.hiv = 1;
+      break;
+    case LOG_STAGE:
+      a.hiv = event.values[1];
+      break;
+    case LOG_ART:
+      a.art = true;
+      break;
+    }
+    return true;
+  }
+
+  void output(const double date)
+  {
+    if (table) {
+      unsigned bands = std::max(1.0, ceil(exit_age - entry_age));
+      std::vector<unsigned> alive(2 * bands), infected(2 * bands),
+	partnered(2 * bands);
+      for (auto& a: agents)
+	if (a.alive) {
+	  unsigned band = std::min(bands - 1.0,
+				   std::max(0.0, floor(date - a.birth -
+						       entry_age)));
+	  unsigned i = a.sex * bands + band;
+	  alive[i] += a.weight;
+	  infected[i] += (a.hiv > 0) * a.weight;
+	  partnered[i] += (a.partners.size() > 0) * a.weight;
+	}
+      for (unsigned i = 0; i < 2 * bands; ++i)
+	std::cout << date << ", " << (i < bands ? "male" : "female") << ", "
+		  << entry_age + i % bands << ", " << alive[i] << ", "
+		  << infected[i] << ", " << partnered[i] << std::endl;
+    } else {
+      Prevalence p;
+      unsigned hiv[6] = {0, 0, 0, 0, 0, 0};
+      for (auto& a: agents)
+	if (a.alive) {
+	  p.agents[a.sex] += 1;
+	  p.alive[a.sex] += a.weight;
+	  p.infected[a.sex] += (a.hiv > 0) * a.weight;
+	  hiv[a.hiv] += a.weight;
+	}
+      for (unsigned s = 0; s < 2; ++s)
+	p.prevalence[s] = (double) p.infected[s] / p.alive[s];
+      report_line(date, agents.size(), p, hiv);
+    }
+  }
+};
+
+// Writes out the transmission tree and what it shows
+static void transmission_summary(const unsigned sim_no,
+				 const TransmissionTree& tree)
+{
+  tree.write(std::cout);
+  std::vector<double> times = tree.generation_times();
+  std::ostringstream prefix_stream;
+  prefix_stream << "summary," << sim_no << ",transmissions,";
+  std::string prefix = prefix_stream.str();
+  std::cout << prefix << "Transmissions," << tree.size() << std::endl;
+  std::cout << prefix << "Fraction from acute," << tree.fraction_from_stage(1)
 	    << std::endl;
-  report(parameters["START_DATE"], agents);
-  simulate(agents, parameters);
-  summary(0, "end", agents, outputs);
-  destroy_agents(agents);
+  std::cout << prefix << "Generation times," << times.size() << std::endl;
+  if (times.size() > 0) {
+    std::cout << prefix << "Mean generation time," << sim::mean(times)
+	      << std::endl;
+    std::cout << prefix << "Median generation time," << sim::median(times)
+	      << std::endl;
+  }
+}
+
+// Parameters can be overridden on the command line with NAME=VALUE
+// arguments. Returns false if an argument doesn't name a parameter.
+static bool parse_arguments(int argc, char *argv[], ParameterMap& parameters)
+{
+  for (int i = 0; i < argc; ++i) {
+    const char *equals = strchr(argv[i], '=');
+    bool found = false;
+    if (equals) {
+      size_t length = equals - argv[i];
+      for (auto& parameter: parameters)
+	if (strncmp(parameter.first, argv[i], length) == 0 &&
+	    parameter.first[length] == '\0') {
+	  parameter.second = atof(equals + 1);
+	  found = true;
+	}
+    }
+    if (!found) {
+      std::cerr << "Unknown parameter: " << argv[i] << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  // Set our parameters
+  ParameterMap parameters, outputs;
+
+  parameters["NUM_YEARS"] = 2.0;
+  parameters["TIME_STEP"] = DAY;
+  parameters["START_DATE"] = 2015.0;
+  parameters["NUM_AGENTS"] = 10000;
+  // Number of people each agent represents
+  parameters["AGENT_WEIGHT"] = 1;
+  /* Set to 1 to draw the initial agents' attributes in batches, with a
+     faster gamma sampler, rather than one agent at a time. */
+  parameters["BATCH_ATTRIBUTES"] = 0.0;
+  /* Set to 1 to give the initial agents attributes from a randomised
+     Sobol' sequence instead, for less variation between replicates. */
+  parameters["QMC_ATTRIBUTES"] = 0.0;
+  // Seed for our Mersenne Twister, arbitrarily chosen
+  parameters["SEED"] = 23;
+  /* 0 steps through all agents every TIME_STEP, 1 uses the next event engine
+     and 2 the hybrid engine, which aggregates single agents into
+     HYBRID_ATTRIBUTE_BINS bins of each of partner forming, relationship
+     stickiness and concurrency (among other strata). */
+  parameters["ENGINE"] = TIME_STEP_ENGINE;
+  parameters["HYBRID_ATTRIBUTE_BINS"] = 8;
+  // Write a CSV line on every TIME_STEP
+  parameters["REPORT"] = 1.0;
+  parameters["BENCHMARK_REPLICATES"] = 5;
+
+  /* How often each class of events runs in the time step engine. Each is
+     rounded to a whole number of TIME_STEPs. */
+  parameters["SEX_TIME_STEP"] = DAY;
+  parameters["STAGE_TIME_STEP"] = DAY;
+  parameters["PARTNERSHIP_TIME_STEP"] = DAY;
+  parameters["DEMOGRAPHY_TIME_STEP"] = DAY;
+
+  /* Parameters to estimate */
+  parameters["MEAN_TIME_UNTIL_PARTNER"] = YEAR / 4.0;
+  parameters["MEAN_PARTNERSHIP_TIME"] = YEAR / 4.0;
+  parameters["MEAN_TIME_CONCURRENT"] = YEAR;
+  parameters["MEAN_TIME_SEX"] = DAY;
+  parameters["PREFERENCE_FIFS"] = 0.5;
+  parameters["MEAN_RISK_HET_MALE_SEX"] = 0.01;
+  parameters["MEAN_RISK_HET_FEMALE_SEX"] = 0.02;
+  parameters["LEAVE_ACUTE_INFECTION"] = 0.0238095238;
+
+  /* Per act transmission. Risks are for an act with a chronically infected
+     partner, by sex of the receiving partner. Set PER_ACT_TRANSMISSION to
+     0 to use the prevalence based infection event instead. */
+  parameters["PER_ACT_TRANSMISSION"] = 1.0;
+  parameters["ACT_RISK_MALE"] = 0.001;
+  parameters["ACT_RISK_FEMALE"] = 0.002;
+  parameters["ACUTE_INFECTIOUSNESS"] = 26.0;
+  parameters["LATE_INFECTIOUSNESS"] = 7.0;
+  parameters["CONDOM_USE"] = 0.3;
+  parameters["CONDOM_EFFICACY"] = 0.8;
+  parameters["ART_EFFICACY"] = 0.96;
+  parameters["ART_INITIATION_RATE"] = 0.1;
+
+  /* Demography: youths enter at ENTRY_AGE and leave the model at EXIT_AGE.
+     Rates are annual. */
+  parameters["ENTRY_AGE"] = 15.0;
+  parameters["EXIT_AGE"] = 20.0;
+  parameters["ENTRY_RATE"] = 0.2;
+  parameters["MORTALITY_HIV_NEGATIVE"] = 0.002;
+  parameters["MORTALITY_HIV_PRIMARY"] = 0.002;
+  parameters["MORTALITY_CDC_1"] = 0.005;
+  parameters["MORTALITY_CDC_2"] = 0.01;
+  parameters["MORTALITY_CDC_3"] = 0.05;
+  parameters["MORTALITY_CDC_4"] = 0.3;
+  // Fraction of dead slots tolerated before the agent vector is compacted
+  parameters["COMPACTION_THRESHOLD"] = 0.05;
+
+  /* Partner matching: male seekers consider this many female seekers on
+     either side of them in matching key order, and agents are re-sorted by
+     matching key this often. */
+  parameters["MATCH_NEIGHBOURHOOD"] = 20;
+  parameters["REORDER_INTERVAL"] = MONTH;
+  /* Matching algorithm of the time step and hybrid engines: 0 for nearest
+     key matching, 1 for stable matching on preference lists of the
+     STABLE_MATCH_CANDIDATES nearest seekers, proposing on MATCH_THREADS
+     threads (0 for as many as the hardware supports), 2 for matching
+     within buckets of LSH_BUCKET_WIDTH (on the [0, 1] scale of each
+     matching attribute), or 3 for up to HANDSHAKE_ROUNDS rounds of
+     parallel nearest key matching by mutual choice on MATCH_THREADS
+     threads. 4 matches on age alone, in AGE_MIXING_BANDS bands, with
+     males a normally distributed AGE_MIXING_GAP (AGE_MIXING_SD) years
+     older than their partners, trying up to MATCH_NEIGHBOURHOOD times
+     per male. */
+  parameters["MATCHING"] = NEAREST_KEY_MATCHING;
+  parameters["STABLE_MATCH_CANDIDATES"] = 8;
+  parameters["MATCH_THREADS"] = 0;
+  parameters["LSH_BUCKET_WIDTH"] = 0.5;
+  parameters["HANDSHAKE_ROUNDS"] = 8;
+  parameters["AGE_MIXING_BANDS"] = 5;
+  parameters["AGE_MIXING_GAP"] = 1.0;
+  parameters["AGE_MIXING_SD"] = 1.5;
+  /* Set SEEKER_POOL to 1 for seekers who aren't matched straight away to
+     wait up to SEEKER_EXPIRY for a partner (time step engine only). */
+  parameters["SEEKER_POOL"] = 0.0;
+  parameters["SEEKER_EXPIRY"] = WEEK;
+  /* Set to 1 to start with a partnership network sampled from its
+     equilibrium, rather than with everyone single. */
+  parameters["EQUILIBRIUM_NETWORK"] = 0.0;
+  /* Burn-in before the measured phase, ended early once prevalence and
+     the partnership network stop drifting (see burn_in). 0 disables it. */
+  parameters["MAX_BURN_IN"] = 0.0;
+  parameters["BURN_IN_SAMPLE_INTERVAL"] = WEEK;
+  parameters["BURN_IN_WINDOW"] = 0.5;
+  parameters["BURN_IN_TOLERANCE"] = 0.02;
+  // Resolution of times in the event log
+  parameters["EVENT_LOG_TICK"] = HOUR;
+  /* The replay command writes a line every REPLAY_INTERVAL: a report()
+     line, or with REPLAY_TABLE set to 1 a table by sex and age. */
+  parameters["REPLAY_INTERVAL"] = DAY;
+  parameters["REPLAY_TABLE"] = 0.0;
+  // Set to 1 to write out the transmission tree at the end of the run
+  parameters["TRANSMISSION_TREE"] = 0.0;
+  /* Partnership network statistics are written every NETWORK_INTERVAL,
+     if it isn't 0, computed on NETWORK_THREADS threads (0 for as many as
+     the hardware supports). */
+  parameters["NETWORK_INTERVAL"] = 0.0;
+  parameters["NETWORK_THREADS"] = 0;
+  /* Set TRACK_COMPONENTS to 1 to write the number of connected components
+     of the partnership network and the size of the largest every
+     TIME_STEP that is reported (see REPORT), tracked incrementally
+     between rebuilds every COMPONENT_REBUILD_INTERVAL. */
+  parameters["TRACK_COMPONENTS"] = 0.0;
+  parameters["COMPONENT_REBUILD_INTERVAL"] = WEEK;
+
+  /* The first argument, if it isn't a parameter, is the command:
+     simulate (the default), log FILE (simulate, writing the event log of
+     the measured phase to FILE, which ENGINE=2 can't), replay FILE
+     (recompute outputs from the event log in FILE), benchmark-time-steps,
+     benchmark-weights, benchmark-matching or benchmark-sampling. */
+  const char *command = "simulate";
+  const char *log_path = NULL;
+  int first_parameter = 1;
+  if (argc > 1 && !strchr(argv[1], '=')) {
+    command = argv[1];
+    first_parameter = 2;
+  }
+  if (strcmp(command, "log") == 0 || strcmp(command, "replay") == 0) {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " " << command
+		<< " FILE [NAME=VALUE]..." << std::endl;
+      return 1;
+    }
+    log_path = argv[2];
+    first_parameter = 3;
+  }
+  if (!parse_arguments(argc - first_parameter, argv + first_parameter,
+		       parameters))
+    return 1;
+
+  if (strcmp(command, "benchmark-time-steps") == 0) {
+    benchmark_time_steps(parameters);
+    return 0;
+  } else if (strcmp(command, "benchmark-weights") == 0) {
+    benchmark_weights(parameters);
+    return 0;
+  } else if (strcmp(command, "benchmark-matching") == 0) {
+    benchmark_matching(parameters);
+    return 0;
+  } else if (strcmp(command, "benchmark-sampling") == 0) {
+    benchmark_sampling(parameters);
+    return 0;
+  } else if (strcmp(command, "replay") == 0) {
+    return Replay(parameters).run(log_path) ? 0 : 1;
+  } else if (strcmp(command, "simulate") != 0 && !log_path) {
+    std::cerr << "Unknown command: " << command << std::endl;
+    return 1;
+  } else if (log_path && parameters.at("ENGINE") == HYBRID_ENGINE) {
+    std::cerr << "The hybrid engine (ENGINE=2) can't write an event log"
+	      << std::endl;
+    return 1;
+  }
+
+  rng.seed(parameters.at("SEED"));
+  Population population;
+  initialize_agents(population, parameters.at("NUM_AGENTS"), parameters);
+  std::unique_ptr<sim::event_log_writer> writer;
+  if (log_path) {
+    writer.reset(new sim::event_log_writer(log_path,
+					   parameters.at("EVENT_LOG_TICK")));
+    if (!writer->good()) {
+      std::cerr << "Can't open event log: " << log_path << std::endl;
+      return 1;
+    }
+    population.log.writer = writer.get();
+  }
+  simulate(population, parameters, &outputs);
+  summary(0, "end", population, outputs);
+  if (parameters.at("TRANSMISSION_TREE") != 0.0)
+    transmission_summary(0, population.transmissions);
 }
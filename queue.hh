@@ -0,0 +1,132 @@
+#ifndef __SIM_QUEUE_H__
+#define __SIM_QUEUE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace sim  {
+
+  /*
+    Binary min heap of keys ordered by priority, where the keys are small
+    integers (such as agent handles). The position of every key in the heap
+    is tracked so that a key's priority can be changed, or the key removed,
+    in O(log n). Memory is proportional to the largest key pushed.
+  */
+  template <typename PriorityType = double>
+  class indexed_priority_queue
+  {
+  public:
+    typedef uint32_t key_type;
+    typedef PriorityType priority_type;
+
+    bool empty() const { return heap.size() == 0; }
+    size_t size() const { return heap.size(); }
+
+    bool contains(const key_type key) const
+    {
+      return key < positions.size() && positions[key] != absent;
+    }
+
+    key_type top() const { return heap[0]; }
+    priority_type top_priority() const { return priorities[heap[0]]; }
+    priority_type priority(const key_type key) const
+    {
+      return priorities[key];
+    }
+
+    // Inserts key, or changes its priority if it is already queued
+    void push(const key_type key, const priority_type priority)
+    {
+      if (key >= positions.size()) {
+	positions.resize(key + 1, absent);
+	priorities.resize(key + 1);
+      }
+      if (positions[key] == absent) {
+	positions[key] = heap.size();
+	heap.push_back(key);
+	priorities[key] = priority;
+	sift_up(heap.size() - 1);
+      } else {
+	priority_type old = priorities[key];
+	priorities[key] = priority;
+	if (priority < old)
+	  sift_up(positions[key]);
+	else
+	  sift_down(positions[key]);
+      }
+    }
+
+    void pop()
+    {
+      remove(heap[0]);
+    }
+
+    void remove(const key_type key)
+    {
+      if (!contains(key))
+	return;
+      size_t i = positions[key];
+      move(heap.size() - 1, i);
+      heap.pop_back();
+      positions[key] = absent;
+      if (i < heap.size()) {
+	sift_up(i);
+	sift_down(i);
+      }
+    }
+
+  private:
+    static const uint32_t absent = std::numeric_limits<uint32_t>::max();
+
+    std::vector<key_type> heap;
+    std::vector<uint32_t> positions;
+    std::vector<priority_type> priorities;
+
+    void move(const size_t from, const size_t to)
+    {
+      heap[to] = heap[from];
+      positions[heap[to]] = to;
+    }
+
+    void sift_up(size_t i)
+    {
+      key_type key = heap[i];
+      while (i > 0) {
+	size_t parent = (i - 1) / 2;
+	if (!(priorities[key] < priorities[heap[parent]]))
+	  break;
+	move(parent, i);
+	i = parent;
+      }
+      heap[i] = key;
+      positions[key] = i;
+    }
+
+    void sift_down(size_t i)
+    {
+      key_type key = heap[i];
+      size_t n = heap.size();
+      for (;;) {
+	size_t child = 2 * i + 1;
+	if (child >= n)
+	  break;
+	if (child + 1 < n &&
+	    priorities[heap[child + 1]] < priorities[heap[child]])
+	  ++child;
+	if (!(priorities[heap[child]] < priorities[key]))
+	  break;
+	move(child, i);
+	i = child;
+      }
+      heap[i] = key;
+      positions[key] = i;
+    }
+  };
+
+  template <typename PriorityType>
+  const uint32_t indexed_priority_queue<PriorityType>::absent;
+}
+
+#endif
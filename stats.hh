@@ -1,8 +1,15 @@
 #ifndef __SIM_STATS_H__
 #define __SIM_STATS_H__
 
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <random>
 #include <iostream>
+#include <limits>
+#include <vector>
 
 namespace sim  {
 
@@ -41,6 +48,522 @@ namespace sim  {
   }
 
 
+  /*
+    Geometric variates (the number of failures before the first success)
+    by inversion of the CDF, from a single uniform variate u in (0, 1].
+    log_q is log(1 - p), which callers drawing repeatedly with the same p
+    should precompute. Results are capped at max.
+  */
+  template <typename RealType>
+  unsigned geometric_variate(const RealType u, const RealType log_q,
+			     const unsigned max)
+  {
+    RealType k = std::floor(std::log(u) / log_q);
+    return k < max ? (unsigned) k : max;
+  }
+
+  /*
+    Same as geometric_variate(u, log(q), n - 1), where q = 1 - p, but walks
+    the CDF instead of taking a logarithm, which is faster for small n.
+  */
+  template <typename RealType>
+  unsigned truncated_geometric_variate(const RealType u, const RealType q,
+				       const unsigned n)
+  {
+    RealType survival = q;
+    for (unsigned k = 0; k + 1 < n; ++k) {
+      if (u >= survival)
+	return k;
+      survival *= q;
+    }
+    return n - 1;
+  }
+
+  /*
+    Streaming drift test over a sliding window of the last 2n values
+    pushed: drift() is the relative difference between the mean of the
+    newer n and the mean of the older n. Each push is O(1).
+  */
+  template <typename RealType = double>
+  class window_drift
+  {
+  public:
+    explicit window_drift(const size_t n = 1)
+      : values(2 * n), next(0), count(0), older(0.0), newer(0.0) { }
+
+    void push(const RealType x)
+    {
+      size_t n = values.size() / 2;
+      if (count >= n) {
+	RealType middle = values[(next + n) % values.size()];
+	newer -= middle;
+	older += middle;
+      }
+      if (count >= values.size())
+	older -= values[next];
+      values[next] = x;
+      newer += x;
+      next = (next + 1) % values.size();
+      ++count;
+    }
+
+    bool full() const { return count >= values.size(); }
+
+    RealType drift() const
+    {
+      if (older == 0.0)
+	return newer == 0.0 ? 0.0 : std::numeric_limits<RealType>::infinity();
+      return std::fabs(newer - older) / std::fabs(older);
+    }
+
+  private:
+    std::vector<RealType> values;
+    size_t next, count;
+    // Sums of the older and newer halves of the window
+    RealType older, newer;
+  };
+
+  /*
+    Walker's alias method, with Vose's setup: after O(n) setup from the
+    weights of 0 to n - 1, draws from the discrete distribution they
+    define in O(1), from a single uniform variate. The weights needn't be
+    normalised, but must not all be zero.
+
+    generate() draws a batch, taking the bin and the coin toss from the
+    high and low halves of the product of one 32 bit engine output and n,
+    so probabilities are resolved to 2^-32 and n must be below 2^32.
+  */
+  template <typename IntType = unsigned, typename RealType = double>
+  class alias_table
+  {
+  public:
+    typedef IntType result_type;
+
+    alias_table() { }
+    explicit alias_table(const std::vector<RealType>& weights)
+    {
+      init(weights);
+    }
+
+    void init(const std::vector<RealType>& weights)
+    {
+      size_t n = weights.size();
+      RealType total = 0;
+      for (auto& w: weights)
+	total += w;
+      probabilities.resize(n);
+      aliases.resize(n);
+      thresholds.resize(n);
+      std::vector<RealType> scaled(n);
+      std::vector<IntType> small, large;
+      for (size_t i = 0; i < n; ++i) {
+	scaled[i] = weights[i] * n / total;
+	(scaled[i] < 1 ? small : large).push_back(i);
+      }
+      while (small.size() > 0 && large.size() > 0) {
+	IntType s = small.back(), l = large.back();
+	small.pop_back();
+	probabilities[s] = scaled[s];
+	aliases[s] = l;
+	scaled[l] += scaled[s] - 1;
+	if (scaled[l] < 1) {
+	  large.pop_back();
+	  small.push_back(l);
+	}
+      }
+      // Whatever is left has probability 1 up to rounding error
+      for (auto i: small) {
+	probabilities[i] = 1;
+	aliases[i] = i;
+      }
+      for (auto i: large) {
+	probabilities[i] = 1;
+	aliases[i] = i;
+      }
+      for (size_t i = 0; i < n; ++i)
+	thresholds[i] = std::min<RealType>(probabilities[i], 1) * 4294967296.0;
+    }
+
+    size_t size() const { return probabilities.size(); }
+
+    template <typename URNG>
+    result_type operator()(URNG& engine) const
+    {
+      RealType u = std::generate_canonical<RealType,
+		     std::numeric_limits<RealType>::digits>(engine) *
+	probabilities.size();
+      size_t i = std::min<size_t>(u, probabilities.size() - 1);
+      return u - i < probabilities[i] ? i : aliases[i];
+    }
+
+    // Writes n draws to out
+    template <typename URNG, typename OutputIterator>
+    void generate(URNG& engine, OutputIterator out, size_t n) const
+    {
+      static_assert(URNG::max() - URNG::min() >= 0xffffffffULL,
+		    "alias_table::generate needs 32 bit engine outputs");
+      const uint64_t size = probabilities.size();
+      const uint64_t* coins = thresholds.data();
+      const IntType* other = aliases.data();
+      for (; n > 0; --n, ++out) {
+	uint64_t x = ((engine() - URNG::min()) & 0xffffffffULL) * size;
+	uint64_t i = x >> 32;
+	*out = (x & 0xffffffffULL) < coins[i] ? (IntType) i : other[i];
+      }
+    }
+
+  private:
+    std::vector<RealType> probabilities;
+    std::vector<IntType> aliases;
+    // probabilities scaled to 2^32, for generate()
+    std::vector<uint64_t> thresholds;
+  };
+
+  /*
+    Standard normal variates by Marsaglia and Tsang's ziggurat method,
+    with 128 layers. Most draws take one 32 bit engine output, a table
+    lookup and a multiplication; the rest fall back to exact sampling of
+    the wedges and tail. The engine must give at least 32 random bits.
+  */
+  template <typename RealType = double>
+  class ziggurat_normal
+  {
+  public:
+    typedef RealType result_type;
+
+    template <typename URNG>
+    result_type operator()(URNG& engine) const
+    {
+      const tables& t = layers();
+      for (;;) {
+	int32_t h = bits(engine);
+	uint32_t i = h & 127;
+	if ((uint32_t) std::abs((int64_t) h) < t.k[i])
+	  return h * t.w[i];
+	RealType x = h * t.w[i];
+	if (i == 0) {
+	  // The tail, beyond r
+	  RealType y;
+	  do {
+	    x = -std::log(uniform(engine)) / r;
+	    y = -std::log(uniform(engine));
+	  } while (y + y < x * x);
+	  return h > 0 ? r + x : -r - x;
+	}
+	if (t.f[i] + uniform(engine) * (t.f[i - 1] - t.f[i]) <
+	    std::exp(-0.5 * x * x))
+	  return x;
+      }
+    }
+
+    // A uniform variate in (0, 1) from 32 engine bits
+    template <typename URNG>
+    static RealType uniform(URNG& engine)
+    {
+      return (bits(engine) + (RealType) 2147483648.5) *
+	(RealType) 2.3283064365386963e-10;
+    }
+
+  private:
+    static constexpr RealType r = 3.442619855899;
+
+    struct tables {
+      uint32_t k[128];
+      RealType w[128], f[128];
+
+      tables()
+      {
+	const double m = 2147483648.0, v = 9.91256303526217e-3;
+	double d = r, t = d, q = v / std::exp(-0.5 * d * d);
+	k[0] = d / q * m;
+	k[1] = 0;
+	w[0] = q / m;
+	w[127] = d / m;
+	f[0] = 1.0;
+	f[127] = std::exp(-0.5 * d * d);
+	for (unsigned i = 126; i >= 1; --i) {
+	  d = std::sqrt(-2.0 * std::log(v / d + std::exp(-0.5 * d * d)));
+	  k[i + 1] = d / t * m;
+	  t = d;
+	  f[i] = std::exp(-0.5 * d * d);
+	  w[i] = d / m;
+	}
+      }
+    };
+
+    static const tables& layers()
+    {
+      static const tables t;
+      return t;
+    }
+
+    template <typename URNG>
+    static int32_t bits(URNG& engine)
+    {
+      static_assert(URNG::max() - URNG::min() >= 0xffffffffULL,
+		    "ziggurat_normal needs 32 bit engine outputs");
+      return (int32_t) (uint32_t) (engine() - URNG::min());
+    }
+  };
+
+  template <typename RealType>
+  constexpr RealType ziggurat_normal<RealType>::r;
+
+  /*
+    Gamma variates with shape alpha and unit scale by Marsaglia and Tsang's
+    method: a cubed, shifted normal variate (from ziggurat_normal) is
+    accepted or rejected, nearly always by a cheap squeeze test. Shapes
+    below 1 are boosted to alpha + 1 and scaled back by u^(1 / alpha).
+
+    generate() draws batches: the candidates and uniforms are drawn first,
+    the squeeze test is applied to them all in a branch free loop that the
+    compiler can vectorise, only the few left undecided take the
+    logarithmic test, and the accepted are packed into the output. Those
+    rejected are drawn again in the next batch.
+  */
+  template <typename RealType = double>
+  class marsaglia_tsang_gamma
+  {
+  public:
+    typedef RealType result_type;
+
+    explicit marsaglia_tsang_gamma(const RealType alpha = 1.0)
+      : alpha_param(alpha), d((alpha < 1 ? alpha + 1 : alpha) - 1.0 / 3.0),
+	c(1 / std::sqrt(9 * d)) { }
+
+    RealType alpha() const { return alpha_param; }
+
+    template <typename URNG>
+    result_type operator()(URNG& engine) const
+    {
+      RealType x, v, u;
+      do {
+	do {
+	  x = normal(engine);
+	  v = 1 + c * x;
+	} while (v <= 0);
+	v = v * v * v;
+	u = normal.uniform(engine);
+      } while (u >= 1 - 0.0331 * x * x * x * x &&
+	       std::log(u) >= 0.5 * x * x + d * (1 - v + std::log(v)));
+      return boost(engine, d * v);
+    }
+
+    // Writes n variates to out
+    template <typename URNG>
+    void generate(URNG& engine, result_type* out, size_t n) const
+    {
+      const size_t batch = 256;
+      RealType x[batch], u[batch], v[batch];
+      uint8_t accept[batch];
+      result_type* first = out;
+      for (size_t left = n; left > 0;) {
+	size_t m = std::min(left, batch);
+	for (size_t k = 0; k < m; ++k) {
+	  x[k] = normal(engine);
+	  u[k] = normal.uniform(engine);
+	}
+	for (size_t k = 0; k < m; ++k) {
+	  RealType t = 1 + c * x[k];
+	  RealType x2 = x[k] * x[k];
+	  v[k] = t * t * t;
+	  accept[k] = (t > 0) & (u[k] < 1 - 0.0331 * x2 * x2);
+	}
+	for (size_t k = 0; k < m; ++k) {
+	  if (!accept[k] && v[k] > 0)
+	    accept[k] = std::log(u[k]) <
+	      0.5 * x[k] * x[k] + d * (1 - v[k] + std::log(v[k]));
+	  if (accept[k]) {
+	    *out++ = d * v[k];
+	    --left;
+	  }
+	}
+      }
+      if (alpha_param < 1)
+	for (result_type* p = first; p != out; ++p)
+	  *p = boost(engine, *p);
+    }
+
+  private:
+    RealType alpha_param, d, c;
+    ziggurat_normal<RealType> normal;
+
+    template <typename URNG>
+    RealType boost(URNG& engine, const RealType x) const
+    {
+      if (alpha_param >= 1)
+	return x;
+      return x * std::pow(normal.uniform(engine), 1 / alpha_param);
+    }
+  };
+
+  /*
+    Regularised incomplete beta function I_x(a, b), the beta distribution's
+    CDF, by the continued fraction of Numerical Recipes (betacf), which
+    converges quickly for x < (a + 1) / (a + b + 2) and is otherwise
+    applied to the symmetric I_{1-x}(b, a).
+  */
+  template <typename RealType>
+  RealType beta_cdf(const RealType x, const RealType a, const RealType b)
+  {
+    if (x <= 0)
+      return 0;
+    if (x >= 1)
+      return 1;
+    if (x > (a + 1) / (a + b + 2))
+      return 1 - beta_cdf(1 - x, b, a);
+    const RealType tiny = 1e-300, epsilon = 1e-15;
+    RealType front = std::exp(std::lgamma(a + b) - std::lgamma(a) -
+			      std::lgamma(b) + a * std::log(x) +
+			      b * std::log(1 - x)) / a;
+    RealType c = 1, d = 1 - (a + b) * x / (a + 1);
+    if (std::fabs(d) < tiny)
+      d = tiny;
+    d = 1 / d;
+    RealType f = d;
+    for (unsigned m = 1; m < 300; ++m) {
+      for (unsigned odd = 0; odd < 2; ++odd) {
+	RealType numerator = odd ?
+	  -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1)) :
+	  m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+	d = 1 + numerator * d;
+	if (std::fabs(d) < tiny)
+	  d = tiny;
+	c = 1 + numerator / c;
+	if (std::fabs(c) < tiny)
+	  c = tiny;
+	d = 1 / d;
+	f *= c * d;
+      }
+      if (std::fabs(c * d - 1) < epsilon)
+	break;
+    }
+    return front * f;
+  }
+
+  /*
+    Quantile function (inverse CDF) of a continuous distribution on [lo,
+    hi], tabulated by bisection of the CDF at the middles of n equal
+    intervals of probability, and interpolated linearly between them (and
+    held constant beyond the first and last). Tabulating the middles keeps
+    the steep ends of the quantile function, where a chord would be far
+    off, from biasing the results.
+  */
+  template <typename RealType = double>
+  class tabulated_quantile
+  {
+  public:
+    tabulated_quantile() { }
+
+    template <typename CDF>
+    tabulated_quantile(CDF cdf, const RealType lo, const RealType hi,
+		       const size_t n = 4096)
+      : table(std::max<size_t>(n, 2))
+    {
+      RealType below = lo;
+      for (size_t i = 0; i < table.size(); ++i) {
+	RealType p = (i + 0.5) / table.size(), above = hi;
+	while (above - below > 1e-12 * (hi - lo)) {
+	  RealType middle = 0.5 * (below + above);
+	  (cdf(middle) < p ? below : above) = middle;
+	}
+	table[i] = below = 0.5 * (below + above);
+      }
+    }
+
+    RealType operator()(const RealType u) const
+    {
+      RealType x = std::max<RealType>(u * table.size() - 0.5, 0);
+      size_t i = std::min<size_t>(x, table.size() - 2);
+      RealType fraction = std::min<RealType>(x - i, 1);
+      return table[i] + fraction * (table[i + 1] - table[i]);
+    }
+
+  private:
+    std::vector<RealType> table;
+  };
+
+  /*
+    Sobol' low discrepancy sequence in up to 8 dimensions, from Joe and
+    Kuo's direction numbers, randomised by Matousek's random linear
+    scrambling and a random digital shift: each engine state gives an
+    unbiased replicate of the sequence that is still low discrepancy.
+    Points are generated in Gray code order, with 32 bits per coordinate.
+  */
+  class sobol_sequence
+  {
+  public:
+    static const unsigned max_dimensions = 8;
+
+    template <typename URNG>
+    sobol_sequence(const unsigned dimensions, URNG& engine)
+      : num_dimensions(dimensions < max_dimensions ? dimensions :
+		       max_dimensions), index(0)
+    {
+      // Degree, coefficients and initial direction numbers of dimensions
+      // 2 onwards
+      static const unsigned s[] = {1, 2, 3, 3, 4, 4, 5};
+      static const unsigned a[] = {0, 1, 1, 2, 1, 4, 2};
+      static const unsigned m[][5] = {
+	{1}, {1, 3}, {1, 3, 1}, {1, 1, 1}, {1, 1, 3, 3}, {1, 3, 5, 13},
+	{1, 1, 5, 5, 17}
+      };
+      std::uniform_int_distribution<uint32_t> bits;
+      for (unsigned j = 0; j < num_dimensions; ++j) {
+	uint32_t v[32];
+	for (unsigned k = 0; k < 32; ++k) {
+	  if (j == 0)
+	    v[k] = 1U << (31 - k);
+	  else if (k < s[j - 1])
+	    v[k] = m[j - 1][k] << (31 - k);
+	  else {
+	    unsigned degree = s[j - 1];
+	    v[k] = v[k - degree] ^ (v[k - degree] >> degree);
+	    for (unsigned i = 1; i < degree; ++i)
+	      if ((a[j - 1] >> (degree - 1 - i)) & 1)
+		v[k] ^= v[k - i];
+	  }
+	}
+	// Lower triangular, with a unit diagonal, from the most significant
+	// bit down
+	uint32_t scramble[32];
+	for (unsigned i = 0; i < 32; ++i)
+	  scramble[i] = 1U << (31 - i) |
+	    (i > 0 ? bits(engine) & ~(0xffffffffU >> i) : 0);
+	for (unsigned k = 0; k < 32; ++k) {
+	  directions[j][k] = 0;
+	  for (unsigned i = 0; i < 32; ++i)
+	    if (std::bitset<32>(scramble[i] & v[k]).count() & 1)
+	      directions[j][k] |= 1U << (31 - i);
+	}
+	state[j] = bits(engine);
+      }
+    }
+
+    unsigned dimensions() const { return num_dimensions; }
+
+    // Writes the next point, in (0, 1)^dimensions(), to x
+    template <typename RealType>
+    void next(RealType* x)
+    {
+      for (unsigned j = 0; j < num_dimensions; ++j)
+	x[j] = (state[j] + (RealType) 0.5) * (RealType) 2.3283064365386963e-10;
+      unsigned c = 0;
+      for (uint32_t i = index; i & 1; i >>= 1)
+	++c;
+      if (c < 32)
+	for (unsigned j = 0; j < num_dimensions; ++j)
+	  state[j] ^= directions[j][c];
+      ++index;
+    }
+
+  private:
+    unsigned num_dimensions;
+    uint32_t index;
+    uint32_t directions[max_dimensions][32];
+    uint32_t state[max_dimensions];
+  };
+
   template <typename RealType = double>
   class beta_distribution
   {
@@ -113,6 +636,21 @@ namespace sim  {
     }
 
 
+    /*
+      Writes n variates to out, drawing their gamma variates in batches
+      with marsaglia_tsang_gamma rather than one at a time with
+      std::gamma_distribution.
+    */
+    template <typename URNG>
+    void generate(URNG& engine, result_type* out, size_t n) const
+    {
+      std::vector<result_type> y(n);
+      marsaglia_tsang_gamma<result_type>(a()).generate(engine, out, n);
+      marsaglia_tsang_gamma<result_type>(b()).generate(engine, y.data(), n);
+      for (size_t i = 0; i < n; ++i)
+	out[i] /= out[i] + y[i];
+    }
+
     result_type min() const { return 0.0; }
     result_type max() const { return 1.0; }
 